@@ -0,0 +1,52 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * DFU 1.1 class driver, runtime.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include "usb-u2-dfu.h"
+
+static uint8_t state = USB_U2_DFU_STATE_APP_IDLE;
+
+
+void
+usb_u2_dfu_runtime_control(const usb_u2_control_request_t *req)
+{
+    if ((req->bmRequestType & USB_U2_REQ_TYPE_MASK) != USB_U2_REQ_TYPE_CLASS)
+        return;
+
+    bool dir_in = (req->bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST;
+
+    switch (req->bRequest) {
+        case USB_U2_DFU_REQ_DETACH:
+            if (dir_in)
+                break;
+
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+            state = USB_U2_DFU_STATE_APP_DETACH;
+
+            if (usb_u2_dfu_detach_cb != NULL)
+                usb_u2_dfu_detach_cb(req->wValue);
+            break;
+
+        case USB_U2_DFU_REQ_GETSTATUS: {
+            if (!dir_in)
+                break;
+
+            uint8_t status[6] = {USB_U2_DFU_STATUS_OK, 0, 0, 0, state, 0};
+            usb_u2_control_in(status, sizeof(status), false);
+            break;
+        }
+
+        case USB_U2_DFU_REQ_GETSTATE:
+            if (dir_in)
+                usb_u2_control_in(&state, 1, false);
+            break;
+    }
+}
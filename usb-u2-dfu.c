@@ -0,0 +1,226 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * DFU 1.1 class driver, DFU mode.
+ *
+ * This code calls SPM, so it must be linked into the boot section, with the
+ * interrupt vectors moved there as well (IVSEL), because the RWW section is
+ * not readable while a page is being erased or written.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <avr/boot.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "usb-u2-dfu.h"
+
+#define PROG_IDLE   0
+#define PROG_ERASE  1
+#define PROG_WRITE  2
+
+// time that host should wait before polling again while manifesting, in ms
+#define MANIFEST_POLL_TIMEOUT 10
+
+static uint8_t state = USB_U2_DFU_STATE_DFU_IDLE;
+static uint8_t status = USB_U2_DFU_STATUS_OK;
+static uint8_t prog_step = PROG_IDLE;
+static uint16_t prog_addr;
+static uint8_t block[SPM_PAGESIZE];
+static uint16_t block_addr;
+static bool block_pending = false;
+static bool block_short = false;
+
+
+static void
+program_task(void)
+{
+    // flash programming runs in background, while we keep receiving the
+    // next block from host into ram.
+    if (boot_spm_busy())
+        return;
+
+    switch (prog_step) {
+        case PROG_ERASE:
+            ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+                boot_page_write(prog_addr);
+            }
+            prog_step = PROG_WRITE;
+            return;
+
+        case PROG_WRITE:
+            prog_step = PROG_IDLE;
+            break;
+    }
+
+    if (!block_pending)
+        return;
+
+    // the temporary page buffer survives the page erase, so it can be filled
+    // beforehand, freeing the ram block for the next DNLOAD.
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        for (uint16_t i = 0; i < SPM_PAGESIZE; i += 2)
+            boot_page_fill(block_addr + i, block[i] | (block[i + 1] << 8));
+        boot_page_erase(block_addr);
+    }
+
+    prog_addr = block_addr;
+    prog_step = PROG_ERASE;
+    block_pending = false;
+}
+
+
+static bool
+programming(void)
+{
+    return block_pending || prog_step != PROG_IDLE;
+}
+
+
+void
+usb_u2_dfu_task(void)
+{
+    program_task();
+
+    if (programming())
+        return;
+
+    if (boot_rww_busy())
+        boot_rww_enable();
+
+    // GETSTATUS already reported dfuMANIFEST to host, so the callback is free
+    // to leave the bootloader.
+    if (state != USB_U2_DFU_STATE_DFU_MANIFEST)
+        return;
+
+    state = USB_U2_DFU_STATE_DFU_IDLE;
+
+    if (usb_u2_dfu_manifest_cb != NULL)
+        usb_u2_dfu_manifest_cb();
+}
+
+
+static void
+error(uint8_t st)
+{
+    status = st;
+    state = USB_U2_DFU_STATE_DFU_ERROR;
+}
+
+
+void
+usb_u2_dfu_control(const usb_u2_control_request_t *req)
+{
+    if ((req->bmRequestType & USB_U2_REQ_TYPE_MASK) != USB_U2_REQ_TYPE_CLASS)
+        return;
+
+    bool dir_in = (req->bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST;
+
+    switch (req->bRequest) {
+        case USB_U2_DFU_REQ_DNLOAD: {
+            if (dir_in)
+                break;
+
+            if (state != USB_U2_DFU_STATE_DFU_IDLE && state != USB_U2_DFU_STATE_DFU_DNLOAD_IDLE) {
+                error(USB_U2_DFU_STATUS_ERR_STALLEDPKT);
+                break;
+            }
+
+            if (req->wLength == 0) {
+                if (state == USB_U2_DFU_STATE_DFU_IDLE) {
+                    error(USB_U2_DFU_STATUS_ERR_NOTDONE);
+                    break;
+                }
+
+                usb_u2_control_out(NULL, 0);
+                usb_u2_control_out_status();
+                state = USB_U2_DFU_STATE_DFU_MANIFEST_SYNC;
+                break;
+            }
+
+            if (state == USB_U2_DFU_STATE_DFU_IDLE)
+                block_short = false;
+
+            // block number maps to a flash page, so only the last block
+            // may be shorter than a page.
+            uint32_t addr = (uint32_t) req->wValue * SPM_PAGESIZE;
+            if (req->wLength > SPM_PAGESIZE || block_short || addr >= USB_U2_DFU_APP_SIZE) {
+                error(USB_U2_DFU_STATUS_ERR_ADDRESS);
+                break;
+            }
+            block_short = req->wLength < SPM_PAGESIZE;
+
+            // the previous block is still waiting for the page being
+            // programmed, it must reach the page buffer before we reuse ram.
+            while (block_pending)
+                program_task();
+
+            uint8_t len = usb_u2_control_out(block, req->wLength);
+            usb_u2_control_out_status();
+
+            for (uint16_t i = len; i < SPM_PAGESIZE; i++)
+                block[i] = 0xff;
+            block_addr = addr;
+            block_pending = true;
+            state = USB_U2_DFU_STATE_DFU_DNLOAD_SYNC;
+
+            program_task();
+            break;
+        }
+
+        case USB_U2_DFU_REQ_GETSTATUS: {
+            if (!dir_in)
+                break;
+
+            uint8_t poll_timeout = 0;
+
+            // the block was already accepted, so host can send the next one
+            // right away, there is no need to report dfuDNBUSY.
+            if (state == USB_U2_DFU_STATE_DFU_DNLOAD_SYNC)
+                state = USB_U2_DFU_STATE_DFU_DNLOAD_IDLE;
+
+            // manifestation (finishing the flash writes and calling the
+            // manifest callback) happens in usb_u2_dfu_task(), after this
+            // status reached host.
+            if (state == USB_U2_DFU_STATE_DFU_MANIFEST_SYNC)
+                state = USB_U2_DFU_STATE_DFU_MANIFEST;
+            if (state == USB_U2_DFU_STATE_DFU_MANIFEST)
+                poll_timeout = MANIFEST_POLL_TIMEOUT;
+
+            uint8_t rv[6] = {status, poll_timeout, 0, 0, state, 0};
+            usb_u2_control_in(rv, sizeof(rv), false);
+            break;
+        }
+
+        case USB_U2_DFU_REQ_CLRSTATUS:
+            if (dir_in || state != USB_U2_DFU_STATE_DFU_ERROR)
+                break;
+
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+            status = USB_U2_DFU_STATUS_OK;
+            state = USB_U2_DFU_STATE_DFU_IDLE;
+            break;
+
+        case USB_U2_DFU_REQ_GETSTATE:
+            if (dir_in)
+                usb_u2_control_in(&state, 1, false);
+            break;
+
+        case USB_U2_DFU_REQ_ABORT:
+            if (dir_in)
+                break;
+
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+
+            // blocks already accepted are still programmed, abort only
+            // affects what host sends next.
+            if (state == USB_U2_DFU_STATE_DFU_DNLOAD_IDLE || state == USB_U2_DFU_STATE_DFU_DNLOAD_SYNC)
+                state = USB_U2_DFU_STATE_DFU_IDLE;
+            break;
+    }
+}
@@ -0,0 +1,101 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * DFU 1.1 class driver, runtime and DFU mode.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "usb-u2.h"
+
+
+// Driver settings
+
+#ifndef USB_U2_DFU_APP_SIZE
+#define USB_U2_DFU_APP_SIZE     (FLASHEND + 1 - 4096)  // largest boot section
+#endif
+
+
+// Request (Setup) data macros
+
+#define USB_U2_DFU_REQ_DETACH       0x00
+#define USB_U2_DFU_REQ_DNLOAD       0x01
+#define USB_U2_DFU_REQ_UPLOAD       0x02
+#define USB_U2_DFU_REQ_GETSTATUS    0x03
+#define USB_U2_DFU_REQ_CLRSTATUS    0x04
+#define USB_U2_DFU_REQ_GETSTATE     0x05
+#define USB_U2_DFU_REQ_ABORT        0x06
+
+
+// State and status macros
+
+#define USB_U2_DFU_STATE_APP_IDLE                   0
+#define USB_U2_DFU_STATE_APP_DETACH                 1
+#define USB_U2_DFU_STATE_DFU_IDLE                   2
+#define USB_U2_DFU_STATE_DFU_DNLOAD_SYNC            3
+#define USB_U2_DFU_STATE_DFU_DNBUSY                 4
+#define USB_U2_DFU_STATE_DFU_DNLOAD_IDLE            5
+#define USB_U2_DFU_STATE_DFU_MANIFEST_SYNC          6
+#define USB_U2_DFU_STATE_DFU_MANIFEST               7
+#define USB_U2_DFU_STATE_DFU_MANIFEST_WAIT_RESET    8
+#define USB_U2_DFU_STATE_DFU_UPLOAD_IDLE            9
+#define USB_U2_DFU_STATE_DFU_ERROR                  10
+
+#define USB_U2_DFU_STATUS_OK                0x00
+#define USB_U2_DFU_STATUS_ERR_TARGET        0x01
+#define USB_U2_DFU_STATUS_ERR_FILE          0x02
+#define USB_U2_DFU_STATUS_ERR_WRITE         0x03
+#define USB_U2_DFU_STATUS_ERR_ERASE         0x04
+#define USB_U2_DFU_STATUS_ERR_CHECK_ERASED  0x05
+#define USB_U2_DFU_STATUS_ERR_PROG          0x06
+#define USB_U2_DFU_STATUS_ERR_VERIFY        0x07
+#define USB_U2_DFU_STATUS_ERR_ADDRESS       0x08
+#define USB_U2_DFU_STATUS_ERR_NOTDONE       0x09
+#define USB_U2_DFU_STATUS_ERR_FIRMWARE      0x0a
+#define USB_U2_DFU_STATUS_ERR_VENDOR        0x0b
+#define USB_U2_DFU_STATUS_ERR_USBR          0x0c
+#define USB_U2_DFU_STATUS_ERR_POR           0x0d
+#define USB_U2_DFU_STATUS_ERR_UNKNOWN       0x0e
+#define USB_U2_DFU_STATUS_ERR_STALLEDPKT    0x0f
+
+
+// Descriptor macros
+
+#define USB_U2_DESCR_TYPE_DFU_FUNCTIONAL                0x21
+
+#define USB_U2_DESCR_ITF_SUBCLASS_DFU                   0x01
+#define USB_U2_DESCR_ITF_PROTOCOL_DFU_RUNTIME           0x01
+#define USB_U2_DESCR_ITF_PROTOCOL_DFU_MODE              0x02
+
+#define USB_U2_DESCR_DFU_ATTR_CAN_DNLOAD                (1 << 0)
+#define USB_U2_DESCR_DFU_ATTR_CAN_UPLOAD                (1 << 1)
+#define USB_U2_DESCR_DFU_ATTR_MANIFESTATION_TOLERANT    (1 << 2)
+#define USB_U2_DESCR_DFU_ATTR_WILL_DETACH               (1 << 3)
+
+
+// Descriptor types
+
+typedef struct {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint8_t  bmAttributes;
+    uint16_t wDetachTimeOut;
+    uint16_t wTransferSize;  // must be SPM_PAGESIZE in DFU mode
+    uint16_t bcdDFUVersion;
+} __attribute__((packed)) usb_u2_dfu_functional_descriptor_t;
+
+
+// Library API
+void usb_u2_dfu_runtime_control(const usb_u2_control_request_t *req);
+void usb_u2_dfu_task(void);
+void usb_u2_dfu_control(const usb_u2_control_request_t *req);
+
+
+// Callbacks
+void usb_u2_dfu_detach_cb(uint16_t timeout) __attribute__((weak));
+void usb_u2_dfu_manifest_cb(void) __attribute__((weak));
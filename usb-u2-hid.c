@@ -0,0 +1,210 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * HID class driver.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "usb-u2-hid.h"
+
+static uint8_t ep_in = 0;
+static uint8_t protocol = USB_U2_HID_PROTOCOL_REPORT;
+static uint8_t idle_rate = 0;
+static uint16_t idle_frame = 0;
+static uint8_t last_report[USB_U2_HID_REPORT_SIZE];
+static uint8_t last_report_len = 0;
+static uint8_t queue[USB_U2_HID_QUEUE_SIZE][USB_U2_HID_REPORT_SIZE];
+static uint8_t queue_len[USB_U2_HID_QUEUE_SIZE];
+static uint8_t queue_head = 0;
+static uint8_t queue_count = 0;
+
+
+static uint16_t
+frame_number(void)
+{
+    return UDFNUML | ((UDFNUMH & 0x07) << 8);
+}
+
+
+static bool
+arm_report(const uint8_t *b, uint8_t len)
+{
+    uint8_t uenum = UENUM;
+
+    // the report is written to the fifo as soon as the bank is free, so that
+    // the next IN token from host finds it already there.
+    usb_u2_endpoint_select(ep_in);
+    bool rv = usb_u2_endpoint_in_ready();
+    if (rv) {
+        usb_u2_endpoint_in(b, len);
+        idle_frame = frame_number();
+    }
+
+    UENUM = uenum;
+    return rv;
+}
+
+
+void
+usb_u2_hid_init(uint8_t ep)
+{
+    ep_in = ep;
+    protocol = USB_U2_HID_PROTOCOL_REPORT;
+    idle_rate = 0;
+    last_report_len = 0;
+    queue_head = 0;
+    queue_count = 0;
+}
+
+
+void
+usb_u2_hid_task(void)
+{
+    if (ep_in == 0)
+        return;
+
+    while (queue_count > 0) {
+        if (!arm_report(queue[queue_head], queue_len[queue_head]))
+            return;
+
+        queue_head = (queue_head + 1) % USB_U2_HID_QUEUE_SIZE;
+        queue_count--;
+    }
+
+    // idle rate is in 4ms units, and a frame is 1ms
+    if (idle_rate != 0 && last_report_len != 0 &&
+        ((frame_number() - idle_frame) & 0x07ff) >= (idle_rate << 2))
+        arm_report(last_report, last_report_len);
+}
+
+
+bool
+usb_u2_hid_send_report(const uint8_t *b, uint8_t len)
+{
+    if (ep_in == 0 || b == NULL || len > USB_U2_HID_REPORT_SIZE)
+        return false;
+
+    // skip the queue if it is empty and the bank is free
+    if (queue_count == 0 && arm_report(b, len))
+        goto done;
+
+    if (queue_count == USB_U2_HID_QUEUE_SIZE)
+        return false;
+
+    uint8_t tail = (queue_head + queue_count) % USB_U2_HID_QUEUE_SIZE;
+    memcpy(queue[tail], b, len);
+    queue_len[tail] = len;
+    queue_count++;
+
+done:
+    memcpy(last_report, b, len);
+    last_report_len = len;
+    return true;
+}
+
+
+uint8_t
+usb_u2_hid_get_protocol(void)
+{
+    return protocol;
+}
+
+
+void
+usb_u2_hid_control(const usb_u2_control_request_t *req)
+{
+    bool dir_in = (req->bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST;
+
+    if ((req->bmRequestType & USB_U2_REQ_TYPE_MASK) == USB_U2_REQ_TYPE_STANDARD) {
+        if (!dir_in || req->bRequest != USB_U2_REQ_GET_DESCRIPTOR)
+            return;
+
+        const usb_u2_hid_descriptor_t *desc = usb_u2_hid_descriptor_cb();
+        if (desc == NULL)
+            return;
+
+        switch (req->wValue >> 8) {
+            case USB_U2_DESCR_TYPE_HID:
+                usb_u2_control_in((const uint8_t*) desc, pgm_read_byte(&(desc->bLength)), true);
+                break;
+
+            case USB_U2_DESCR_TYPE_HID_REPORT: {
+                const uint8_t *report = usb_u2_hid_report_descriptor_cb();
+                if (report != NULL)
+                    usb_u2_control_in(report, pgm_read_word(&(desc->wReportDescriptorLength)), true);
+                break;
+            }
+        }
+        return;
+    }
+
+    switch (req->bRequest) {
+        case USB_U2_HID_REQ_GET_REPORT: {
+            if (!dir_in)
+                break;
+
+            if ((req->wValue >> 8) == USB_U2_HID_REPORT_TYPE_INPUT) {
+                usb_u2_control_in(last_report, last_report_len, false);
+                break;
+            }
+
+            if (usb_u2_hid_get_report_cb == NULL)
+                break;
+
+            uint8_t b[USB_U2_HID_REPORT_SIZE];
+            uint8_t len = usb_u2_hid_get_report_cb(req->wValue >> 8, req->wValue, b, sizeof(b));
+            if (len != 0)
+                usb_u2_control_in(b, len, false);
+            break;
+        }
+
+        case USB_U2_HID_REQ_GET_IDLE:
+            if (dir_in)
+                usb_u2_control_in(&idle_rate, 1, false);
+            break;
+
+        case USB_U2_HID_REQ_GET_PROTOCOL:
+            if (dir_in)
+                usb_u2_control_in(&protocol, 1, false);
+            break;
+
+        case USB_U2_HID_REQ_SET_REPORT: {
+            if (dir_in || req->wLength > USB_U2_HID_REPORT_SIZE)
+                break;
+
+            uint8_t b[USB_U2_HID_REPORT_SIZE];
+            uint8_t len = usb_u2_control_out(b, sizeof(b));
+            usb_u2_control_out_status();
+
+            if (usb_u2_hid_set_report_cb != NULL)
+                usb_u2_hid_set_report_cb(req->wValue >> 8, req->wValue, b, len);
+            break;
+        }
+
+        case USB_U2_HID_REQ_SET_IDLE:
+            if (dir_in)
+                break;
+
+            idle_rate = req->wValue >> 8;
+            idle_frame = frame_number();
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+            break;
+
+        case USB_U2_HID_REQ_SET_PROTOCOL:
+            if (dir_in || (req->wValue > USB_U2_HID_PROTOCOL_REPORT))
+                break;
+
+            protocol = req->wValue;
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+            break;
+    }
+}
@@ -0,0 +1,80 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * HID class driver.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "usb-u2.h"
+
+
+// Driver settings
+
+#ifndef USB_U2_HID_REPORT_SIZE
+#define USB_U2_HID_REPORT_SIZE  8
+#endif
+
+#ifndef USB_U2_HID_QUEUE_SIZE
+#define USB_U2_HID_QUEUE_SIZE   4
+#endif
+
+
+// Request (Setup) data macros
+
+#define USB_U2_HID_REQ_GET_REPORT     0x01
+#define USB_U2_HID_REQ_GET_IDLE       0x02
+#define USB_U2_HID_REQ_GET_PROTOCOL   0x03
+#define USB_U2_HID_REQ_SET_REPORT     0x09
+#define USB_U2_HID_REQ_SET_IDLE       0x0a
+#define USB_U2_HID_REQ_SET_PROTOCOL   0x0b
+
+#define USB_U2_HID_REPORT_TYPE_INPUT    0x01
+#define USB_U2_HID_REPORT_TYPE_OUTPUT   0x02
+#define USB_U2_HID_REPORT_TYPE_FEATURE  0x03
+
+#define USB_U2_HID_PROTOCOL_BOOT    0
+#define USB_U2_HID_PROTOCOL_REPORT  1
+
+
+// Descriptor macros
+
+#define USB_U2_DESCR_TYPE_HID                   0x21
+#define USB_U2_DESCR_TYPE_HID_REPORT            0x22
+
+#define USB_U2_DESCR_ITF_SUBCLASS_HID_BOOT      0x01
+#define USB_U2_DESCR_ITF_PROTOCOL_HID_KEYBOARD  0x01
+#define USB_U2_DESCR_ITF_PROTOCOL_HID_MOUSE     0x02
+
+
+// Descriptor types
+
+typedef struct {
+    uint8_t  bLength;
+    uint8_t  bDescriptorType;
+    uint16_t bcdHID;
+    uint8_t  bCountryCode;
+    uint8_t  bNumDescriptors;
+    uint8_t  bReportDescriptorType;
+    uint16_t wReportDescriptorLength;
+} __attribute__((packed)) usb_u2_hid_descriptor_t;
+
+
+// Library API
+void usb_u2_hid_init(uint8_t ep);
+void usb_u2_hid_task(void);
+bool usb_u2_hid_send_report(const uint8_t *b, uint8_t len);
+uint8_t usb_u2_hid_get_protocol(void);
+void usb_u2_hid_control(const usb_u2_control_request_t *req);
+
+
+// Callbacks
+const usb_u2_hid_descriptor_t* usb_u2_hid_descriptor_cb(void);
+const uint8_t* usb_u2_hid_report_descriptor_cb(void);
+uint8_t usb_u2_hid_get_report_cb(uint8_t type, uint8_t id, uint8_t *b, uint8_t len) __attribute__((weak));
+void usb_u2_hid_set_report_cb(uint8_t type, uint8_t id, const uint8_t *b, uint8_t len) __attribute__((weak));
@@ -0,0 +1,129 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * USB-MIDI 1.0 class driver.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include "usb-u2-midi.h"
+
+static uint8_t midi_ep_in = 0;
+static uint8_t midi_ep_out = 0;
+
+
+void
+usb_u2_midi_init(uint8_t ep_in, uint8_t ep_out)
+{
+    midi_ep_in = ep_in;
+    midi_ep_out = ep_out;
+}
+
+
+static bool
+send(const usb_u2_midi_event_t *ev)
+{
+    if (midi_ep_in == 0 || ev == NULL)
+        return false;
+
+    // events are appended to the bank currently being filled. the bank is
+    // only released to the host once it is full, or by usb_u2_midi_task() /
+    // usb_u2_midi_flush(), so dense streams go out in full packets.
+    usb_u2_endpoint_select(midi_ep_in);
+    if (!usb_u2_endpoint_in_ready())
+        return false;
+
+    UEDATX = ev->header;
+    UEDATX = ev->midi[0];
+    UEDATX = ev->midi[1];
+    UEDATX = ev->midi[2];
+
+    if ((UEINTX & (1 << RWAL)) == 0)
+        UEINTX &= ~((1 << TXINI) | (1 << FIFOCON));
+
+    return true;
+}
+
+
+bool
+usb_u2_midi_send(const usb_u2_midi_event_t *ev)
+{
+    uint8_t uenum = UENUM;
+    bool rv = send(ev);
+    UENUM = uenum;
+    return rv;
+}
+
+
+static void
+flush(void)
+{
+    if (midi_ep_in == 0)
+        return;
+
+    usb_u2_endpoint_select(midi_ep_in);
+    if (usb_u2_endpoint_in_ready() && UEBCLX > 0)
+        UEINTX &= ~((1 << NAKINI) | (1 << TXINI) | (1 << FIFOCON));
+}
+
+
+void
+usb_u2_midi_flush(void)
+{
+    uint8_t uenum = UENUM;
+    flush();
+    UENUM = uenum;
+}
+
+
+static void
+task(void)
+{
+    if (midi_ep_in == 0)
+        return;
+
+    // host already polled and got a NAK, so nothing more is going to be packed
+    // in time for it. release whatever we have.
+    usb_u2_endpoint_select(midi_ep_in);
+    if ((UEINTX & (1 << NAKINI)) != 0) {
+        if (usb_u2_endpoint_in_ready() && UEBCLX > 0)
+            UEINTX &= ~((1 << NAKINI) | (1 << TXINI) | (1 << FIFOCON));
+    }
+
+    if (midi_ep_out == 0 || usb_u2_midi_event_cb == NULL)
+        return;
+
+    usb_u2_endpoint_select(midi_ep_out);
+    if (!usb_u2_endpoint_out_received())
+        return;
+
+    // parse events straight from the fifo
+    while (UEBCLX >= sizeof(usb_u2_midi_event_t)) {
+        usb_u2_midi_event_t ev;
+        ev.header = UEDATX;
+        ev.midi[0] = UEDATX;
+        ev.midi[1] = UEDATX;
+        ev.midi[2] = UEDATX;
+
+        // zero padded packets from some hosts
+        if (ev.header == 0)
+            continue;
+
+        usb_u2_midi_event_cb(&ev);
+    }
+
+    UEINTX &= ~((1 << RXOUTI) | (1 << FIFOCON));
+}
+
+
+void
+usb_u2_midi_task(void)
+{
+    uint8_t uenum = UENUM;
+    task();
+    UENUM = uenum;
+}
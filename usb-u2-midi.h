@@ -0,0 +1,73 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * USB-MIDI 1.0 class driver.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "usb-u2.h"
+
+
+// Event packet macros
+
+#define USB_U2_MIDI_CIN_MISC                0x0
+#define USB_U2_MIDI_CIN_CABLE_EVENT         0x1
+#define USB_U2_MIDI_CIN_SYSCOM_2BYTE        0x2
+#define USB_U2_MIDI_CIN_SYSCOM_3BYTE        0x3
+#define USB_U2_MIDI_CIN_SYSEX_START         0x4
+#define USB_U2_MIDI_CIN_SYSEX_END_1BYTE     0x5
+#define USB_U2_MIDI_CIN_SYSEX_END_2BYTE     0x6
+#define USB_U2_MIDI_CIN_SYSEX_END_3BYTE     0x7
+#define USB_U2_MIDI_CIN_NOTE_OFF            0x8
+#define USB_U2_MIDI_CIN_NOTE_ON             0x9
+#define USB_U2_MIDI_CIN_POLY_KEYPRESS       0xa
+#define USB_U2_MIDI_CIN_CONTROL_CHANGE      0xb
+#define USB_U2_MIDI_CIN_PROGRAM_CHANGE      0xc
+#define USB_U2_MIDI_CIN_CHANNEL_PRESSURE    0xd
+#define USB_U2_MIDI_CIN_PITCH_BEND          0xe
+#define USB_U2_MIDI_CIN_SINGLE_BYTE         0xf
+
+#define USB_U2_MIDI_HEADER(cable, cin)      ((((cable) & 0xf) << 4) | ((cin) & 0xf))
+
+
+// Descriptor macros
+
+#define USB_U2_DESCR_ITF_SUBCLASS_AUDIO_CONTROL     0x01
+#define USB_U2_DESCR_ITF_SUBCLASS_MIDI_STREAMING    0x03
+
+#define USB_U2_DESCR_TYPE_CS_INTERFACE              0x24
+#define USB_U2_DESCR_TYPE_CS_ENDPOINT               0x25
+
+#define USB_U2_DESCR_MIDI_SUBTYPE_MS_HEADER         0x01
+#define USB_U2_DESCR_MIDI_SUBTYPE_MS_GENERAL        0x01
+#define USB_U2_DESCR_MIDI_SUBTYPE_IN_JACK           0x02
+#define USB_U2_DESCR_MIDI_SUBTYPE_OUT_JACK          0x03
+#define USB_U2_DESCR_MIDI_SUBTYPE_ELEMENT           0x04
+
+#define USB_U2_DESCR_MIDI_JACK_EMBEDDED             0x01
+#define USB_U2_DESCR_MIDI_JACK_EXTERNAL             0x02
+
+
+// Event types
+
+typedef struct {
+    uint8_t header;
+    uint8_t midi[3];
+} __attribute__((packed)) usb_u2_midi_event_t;
+
+
+// Library API
+void usb_u2_midi_init(uint8_t ep_in, uint8_t ep_out);
+void usb_u2_midi_task(void);
+bool usb_u2_midi_send(const usb_u2_midi_event_t *ev);
+void usb_u2_midi_flush(void);
+
+
+// Callbacks
+void usb_u2_midi_event_cb(const usb_u2_midi_event_t *ev) __attribute__((weak));
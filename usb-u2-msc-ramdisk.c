@@ -0,0 +1,57 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * Simulated RAM disk backend for the mass storage class driver.
+ *
+ * The disk announces USB_U2_MSC_RAMDISK_BLOCKS blocks, but only has
+ * USB_U2_MSC_RAMDISK_SIZE bytes of RAM behind it, that are mirrored over the
+ * whole disk. It is not useful to store files, but exercises the data path
+ * without any storage latency, to measure transport throughput.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "usb-u2-msc.h"
+
+#ifndef USB_U2_MSC_RAMDISK_BLOCKS
+#define USB_U2_MSC_RAMDISK_BLOCKS   128
+#endif
+
+#ifndef USB_U2_MSC_RAMDISK_SIZE
+#define USB_U2_MSC_RAMDISK_SIZE     128
+#endif
+
+#if (USB_U2_MSC_RAMDISK_SIZE % 64) != 0 || (USB_U2_MSC_BLOCK_SIZE % USB_U2_MSC_RAMDISK_SIZE) != 0
+#error "USB_U2_MSC_RAMDISK_SIZE must be a multiple of 64 that divides USB_U2_MSC_BLOCK_SIZE"
+#endif
+
+static uint8_t disk[USB_U2_MSC_RAMDISK_SIZE];
+
+
+bool
+usb_u2_msc_capacity_cb(uint32_t *blocks)
+{
+    *blocks = USB_U2_MSC_RAMDISK_BLOCKS;
+    return true;
+}
+
+
+bool
+usb_u2_msc_read_cb(uint32_t lba, uint16_t offset, uint8_t *b, uint8_t len)
+{
+    (void) lba;
+    memcpy(b, disk + (offset % USB_U2_MSC_RAMDISK_SIZE), len);
+    return true;
+}
+
+
+bool
+usb_u2_msc_write_cb(uint32_t lba, uint16_t offset, const uint8_t *b, uint8_t len)
+{
+    (void) lba;
+    memcpy(disk + (offset % USB_U2_MSC_RAMDISK_SIZE), b, len);
+    return true;
+}
@@ -0,0 +1,481 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * Mass storage class driver (Bulk-Only Transport, SCSI transparent command set).
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include "usb-u2-msc.h"
+
+#define CBW_SIGNATURE   0x43425355UL
+#define CBW_SIZE        31
+#define CSW_SIGNATURE   0x53425355UL
+
+#define CSW_STATUS_PASSED       0x00
+#define CSW_STATUS_FAILED       0x01
+#define CSW_STATUS_PHASE_ERROR  0x02
+
+#define STATE_CBW       0
+#define STATE_DATA_IN   1
+#define STATE_DATA_OUT  2
+#define STATE_CSW       3
+#define STATE_INVALID   4
+
+#define SOURCE_BLOCKS   0
+#define SOURCE_RAM      1
+#define SOURCE_PROGMEM  2
+
+#define SCSI_TEST_UNIT_READY            0x00
+#define SCSI_REQUEST_SENSE              0x03
+#define SCSI_INQUIRY                    0x12
+#define SCSI_MODE_SENSE_6               0x1a
+#define SCSI_START_STOP_UNIT            0x1b
+#define SCSI_PREVENT_ALLOW_REMOVAL      0x1e
+#define SCSI_READ_FORMAT_CAPACITIES     0x23
+#define SCSI_READ_CAPACITY_10           0x25
+#define SCSI_READ_10                    0x28
+#define SCSI_WRITE_10                   0x2a
+#define SCSI_VERIFY_10                  0x2f
+
+static uint8_t msc_ep_in = 0;
+static uint8_t msc_ep_out = 0;
+static uint8_t state = STATE_CBW;
+static uint32_t tag;
+static uint32_t residue;   // bytes announced by host and not transferred yet
+static uint32_t xfer_len;  // bytes that the command will actually transfer
+static uint8_t csw_status;
+static uint8_t sense_key;
+static uint8_t sense_asc;
+static uint32_t lba;
+static uint16_t block_offset;
+static uint8_t source;
+static const uint8_t *reply;
+static uint8_t reply_buf[18];
+
+static const struct {
+    uint8_t header[8];
+    char    vendor[8];
+    char    product[16];
+    char    revision[4];
+} __attribute__((packed)) inquiry_data PROGMEM = {
+    .header = {
+        0x00,  // direct access block device
+        0x80,  // removable
+        0x04,  // SPC-2
+        0x02,  // response data format
+        36 - 5,
+        0x00, 0x00, 0x00,
+    },
+    .vendor = USB_U2_MSC_INQUIRY_VENDOR,
+    .product = USB_U2_MSC_INQUIRY_PRODUCT,
+    .revision = USB_U2_MSC_INQUIRY_REVISION,
+};
+
+
+void
+usb_u2_msc_init(uint8_t ep_in, uint8_t ep_out)
+{
+    msc_ep_in = ep_in;
+    msc_ep_out = ep_out;
+    state = STATE_CBW;
+    sense_key = USB_U2_MSC_SENSE_KEY_NONE;
+    sense_asc = 0;
+}
+
+
+static uint8_t
+endpoint_size(void)
+{
+    // read from the selected endpoint when used, as init may run before
+    // the endpoints are configured.
+    return 8 << ((UECFG1X >> EPSIZE0) & 0x07);
+}
+
+
+static void
+stall_endpoints(void)
+{
+    usb_u2_endpoint_select(msc_ep_in);
+    UECONX |= (1 << STALLRQ);
+    usb_u2_endpoint_select(msc_ep_out);
+    UECONX |= (1 << STALLRQ);
+}
+
+
+static uint32_t
+read_le32(void)
+{
+    uint32_t rv = UEDATX;
+    rv |= (uint32_t) UEDATX << 8;
+    rv |= (uint32_t) UEDATX << 16;
+    rv |= (uint32_t) UEDATX << 24;
+    return rv;
+}
+
+
+static void
+write_le32(uint32_t v)
+{
+    UEDATX = v;
+    UEDATX = v >> 8;
+    UEDATX = v >> 16;
+    UEDATX = v >> 24;
+}
+
+
+static void
+put_be32(uint8_t *b, uint32_t v)
+{
+    b[0] = v >> 24;
+    b[1] = v >> 16;
+    b[2] = v >> 8;
+    b[3] = v;
+}
+
+
+static void
+fail(uint8_t key, uint8_t asc)
+{
+    csw_status = CSW_STATUS_FAILED;
+    sense_key = key;
+    sense_asc = asc;
+    xfer_len = 0;
+}
+
+
+static bool
+check_range(uint32_t count)
+{
+    uint32_t blocks;
+    if (!usb_u2_msc_capacity_cb(&blocks)) {
+        fail(USB_U2_MSC_SENSE_KEY_NOT_READY, 0x3a);
+        return false;
+    }
+
+    if (lba >= blocks || count > blocks - lba) {
+        fail(USB_U2_MSC_SENSE_KEY_ILLEGAL_REQUEST, 0x21);
+        return false;
+    }
+
+    return true;
+}
+
+
+static void
+handle_cbw(void)
+{
+    usb_u2_endpoint_select(msc_ep_out);
+    if (!usb_u2_endpoint_out_received())
+        return;
+
+    // invalid or non meaningful CBWs stall both endpoints until host does a
+    // reset recovery (BOT 6.6.1)
+    if (UEBCLX != CBW_SIZE || read_le32() != CBW_SIGNATURE) {
+        UEINTX &= ~((1 << RXOUTI) | (1 << FIFOCON));
+        stall_endpoints();
+        state = STATE_INVALID;
+        return;
+    }
+
+    tag = read_le32();
+    residue = read_le32();
+    bool dir_in = (UEDATX & 0x80) != 0;
+    uint8_t dummy = UEDATX;  // bCBWLUN, we only support LUN 0
+    dummy = UEDATX;          // bCBWCBLength
+    (void) dummy;
+
+    uint8_t cb[10];
+    for (uint8_t i = 0; i < sizeof(cb); i++)
+        cb[i] = UEDATX;
+
+    UEINTX &= ~((1 << RXOUTI) | (1 << FIFOCON));
+
+    csw_status = CSW_STATUS_PASSED;
+    xfer_len = 0;
+    source = SOURCE_RAM;
+    reply = reply_buf;
+
+    bool cmd_in = true;
+
+    switch (cb[0]) {
+        case SCSI_TEST_UNIT_READY:
+            if (usb_u2_msc_ready_cb != NULL && !usb_u2_msc_ready_cb())
+                fail(USB_U2_MSC_SENSE_KEY_NOT_READY, 0x3a);
+            break;
+
+        case SCSI_REQUEST_SENSE:
+            for (uint8_t i = 0; i < sizeof(reply_buf); i++)
+                reply_buf[i] = 0;
+            reply_buf[0] = 0x70;
+            reply_buf[2] = sense_key;
+            reply_buf[7] = sizeof(reply_buf) - 8;
+            reply_buf[12] = sense_asc;
+            xfer_len = sizeof(reply_buf);
+            sense_key = USB_U2_MSC_SENSE_KEY_NONE;
+            sense_asc = 0;
+            break;
+
+        case SCSI_INQUIRY:
+            source = SOURCE_PROGMEM;
+            reply = (const uint8_t*) &inquiry_data;
+            xfer_len = sizeof(inquiry_data);
+            break;
+
+        case SCSI_MODE_SENSE_6:
+            reply_buf[0] = 3;
+            reply_buf[1] = 0;
+            reply_buf[2] = 0;
+            reply_buf[3] = 0;
+            xfer_len = 4;
+            break;
+
+        case SCSI_READ_FORMAT_CAPACITIES:
+        case SCSI_READ_CAPACITY_10: {
+            uint32_t blocks;
+            if (!usb_u2_msc_capacity_cb(&blocks) || blocks == 0) {
+                fail(USB_U2_MSC_SENSE_KEY_NOT_READY, 0x3a);
+                break;
+            }
+
+            if (cb[0] == SCSI_READ_CAPACITY_10) {
+                put_be32(reply_buf, blocks - 1);
+                put_be32(reply_buf + 4, USB_U2_MSC_BLOCK_SIZE);
+                xfer_len = 8;
+                break;
+            }
+
+            put_be32(reply_buf, 8);
+            put_be32(reply_buf + 4, blocks);
+            put_be32(reply_buf + 8, USB_U2_MSC_BLOCK_SIZE);
+            reply_buf[8] = 0x02;  // formatted media
+            xfer_len = 12;
+            break;
+        }
+
+        case SCSI_START_STOP_UNIT:
+        case SCSI_PREVENT_ALLOW_REMOVAL:
+        case SCSI_VERIFY_10:
+            break;
+
+        case SCSI_READ_10:
+        case SCSI_WRITE_10: {
+            cmd_in = cb[0] == SCSI_READ_10;
+            lba = ((uint32_t) cb[2] << 24) | ((uint32_t) cb[3] << 16) | ((uint32_t) cb[4] << 8) | cb[5];
+            uint32_t count = ((uint16_t) cb[7] << 8) | cb[8];
+            if (!check_range(count))
+                break;
+
+            source = SOURCE_BLOCKS;
+            block_offset = 0;
+            xfer_len = count * USB_U2_MSC_BLOCK_SIZE;
+            break;
+        }
+
+        default:
+            cmd_in = dir_in;
+            fail(USB_U2_MSC_SENSE_KEY_ILLEGAL_REQUEST, 0x20);
+    }
+
+    // host wants less than the command would send, just truncate replies
+    if (source != SOURCE_BLOCKS && xfer_len > residue)
+        xfer_len = residue;
+
+    if ((xfer_len > residue) || (xfer_len > 0 && cmd_in != dir_in)) {
+        csw_status = CSW_STATUS_PHASE_ERROR;
+        xfer_len = 0;
+    }
+
+    if (residue == 0)
+        state = STATE_CSW;
+    else
+        state = dir_in ? STATE_DATA_IN : STATE_DATA_OUT;
+}
+
+
+static void
+handle_data_in(void)
+{
+    usb_u2_endpoint_select(msc_ep_in);
+    if (!usb_u2_endpoint_in_ready())
+        return;
+
+    uint8_t size = endpoint_size();
+    uint8_t chunk = xfer_len > size ? size : xfer_len;
+
+    switch (source) {
+        case SOURCE_BLOCKS: {
+            // packets never cross block boundaries, as endpoint size divides
+            // block size, so a single callback call fills a whole packet.
+            uint8_t b[64];
+            if (chunk > 0 && !usb_u2_msc_read_cb(lba, block_offset, b, chunk)) {
+                fail(USB_U2_MSC_SENSE_KEY_MEDIUM_ERROR, 0x11);
+                chunk = 0;
+            }
+
+            for (uint8_t i = 0; i < chunk; i++)
+                UEDATX = b[i];
+
+            block_offset += chunk;
+            if (block_offset == USB_U2_MSC_BLOCK_SIZE) {
+                block_offset = 0;
+                lba++;
+            }
+            break;
+        }
+
+        case SOURCE_RAM:
+            for (uint8_t i = 0; i < chunk; i++)
+                UEDATX = reply[i];
+            reply += chunk;
+            break;
+
+        case SOURCE_PROGMEM:
+            for (uint8_t i = 0; i < chunk; i++)
+                UEDATX = pgm_read_byte(&(reply[i]));
+            reply += chunk;
+            break;
+    }
+
+    UEINTX &= ~((1 << TXINI) | (1 << FIFOCON));
+    xfer_len -= chunk;
+    residue -= chunk;
+
+    // a short packet (including zlp) tells the host that data stage is over
+    if (xfer_len == 0 && (residue == 0 || chunk < size))
+        state = STATE_CSW;
+}
+
+
+static void
+handle_data_out(void)
+{
+    usb_u2_endpoint_select(msc_ep_out);
+    if (!usb_u2_endpoint_out_received())
+        return;
+
+    uint8_t b[64];
+    uint8_t size = endpoint_size();
+    uint8_t chunk = UEBCLX;
+    if (chunk > sizeof(b))
+        chunk = sizeof(b);
+    if (chunk > residue)
+        chunk = residue;
+
+    for (uint8_t i = 0; i < chunk; i++)
+        b[i] = UEDATX;
+
+    UEINTX &= ~((1 << RXOUTI) | (1 << FIFOCON));
+
+    // data not wanted by the command is discarded
+    uint8_t len = xfer_len > chunk ? chunk : xfer_len;
+    if (len > 0) {
+        if (usb_u2_msc_write_cb(lba, block_offset, b, len)) {
+            block_offset += len;
+            if (block_offset == USB_U2_MSC_BLOCK_SIZE) {
+                block_offset = 0;
+                lba++;
+            }
+            xfer_len -= len;
+        }
+        else {
+            fail(USB_U2_MSC_SENSE_KEY_MEDIUM_ERROR, 0x03);
+        }
+    }
+
+    residue -= chunk;
+
+    if (residue == 0 || chunk < size)
+        state = STATE_CSW;
+}
+
+
+static void
+handle_csw(void)
+{
+    usb_u2_endpoint_select(msc_ep_in);
+    if (!usb_u2_endpoint_in_ready())
+        return;
+
+    write_le32(CSW_SIGNATURE);
+    write_le32(tag);
+    write_le32(residue);
+    UEDATX = csw_status;
+    UEINTX &= ~((1 << TXINI) | (1 << FIFOCON));
+
+    state = STATE_CBW;
+}
+
+
+static void
+task(void)
+{
+    if (msc_ep_in == 0 || msc_ep_out == 0)
+        return;
+
+    switch (state) {
+        case STATE_CBW:
+            handle_cbw();
+            break;
+
+        case STATE_DATA_IN:
+            handle_data_in();
+            break;
+
+        case STATE_DATA_OUT:
+            handle_data_out();
+            break;
+
+        case STATE_INVALID:
+            // keep stalling, even if host cleared the halt feature
+            stall_endpoints();
+            return;
+    }
+
+    // send the status as soon as possible, without waiting for another task call
+    if (state == STATE_CSW)
+        handle_csw();
+}
+
+
+void
+usb_u2_msc_task(void)
+{
+    uint8_t uenum = UENUM;
+    task();
+    UENUM = uenum;
+}
+
+
+void
+usb_u2_msc_control(const usb_u2_control_request_t *req)
+{
+    if ((req->bmRequestType & USB_U2_REQ_TYPE_MASK) != USB_U2_REQ_TYPE_CLASS)
+        return;
+
+    switch (req->bRequest) {
+        case USB_U2_MSC_REQ_GET_MAX_LUN: {
+            if ((req->bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_HOST_TO_DEVICE)
+                break;
+
+            uint8_t max_lun = 0;
+            usb_u2_control_in(&max_lun, 1, false);
+            break;
+        }
+
+        case USB_U2_MSC_REQ_RESET:
+            if ((req->bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST)
+                break;
+
+            // host clears the endpoint halts afterwards, with CLEAR_FEATURE
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+            state = STATE_CBW;
+            break;
+    }
+}
@@ -0,0 +1,71 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * Mass storage class driver (Bulk-Only Transport, SCSI transparent command set).
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "usb-u2.h"
+
+
+// Driver settings
+
+#ifndef USB_U2_MSC_BLOCK_SIZE
+#define USB_U2_MSC_BLOCK_SIZE           512
+#endif
+
+#ifndef USB_U2_MSC_INQUIRY_VENDOR
+#define USB_U2_MSC_INQUIRY_VENDOR       "usb-u2  "          // 8 chars
+#endif
+
+#ifndef USB_U2_MSC_INQUIRY_PRODUCT
+#define USB_U2_MSC_INQUIRY_PRODUCT      "Mass Storage    "  // 16 chars
+#endif
+
+#ifndef USB_U2_MSC_INQUIRY_REVISION
+#define USB_U2_MSC_INQUIRY_REVISION     "0001"              // 4 chars
+#endif
+
+
+// Request (Setup) data macros
+
+#define USB_U2_MSC_REQ_GET_MAX_LUN      0xfe
+#define USB_U2_MSC_REQ_RESET            0xff
+
+
+// Descriptor macros
+
+#define USB_U2_DESCR_ITF_SUBCLASS_MSC_SCSI      0x06
+#define USB_U2_DESCR_ITF_PROTOCOL_MSC_BOT       0x50
+
+
+// SCSI sense macros
+
+#define USB_U2_MSC_SENSE_KEY_NONE               0x00
+#define USB_U2_MSC_SENSE_KEY_NOT_READY          0x02
+#define USB_U2_MSC_SENSE_KEY_MEDIUM_ERROR       0x03
+#define USB_U2_MSC_SENSE_KEY_ILLEGAL_REQUEST    0x05
+#define USB_U2_MSC_SENSE_KEY_DATA_PROTECT       0x07
+
+
+// Library API
+
+// an invalid CBW stalls both endpoints until host does a reset recovery:
+// the Bulk-Only Mass Storage Reset request, and CLEAR_FEATURE(ENDPOINT_HALT)
+// on both endpoints afterwards.
+void usb_u2_msc_init(uint8_t ep_in, uint8_t ep_out);
+void usb_u2_msc_task(void);
+void usb_u2_msc_control(const usb_u2_control_request_t *req);
+
+
+// Callbacks
+bool usb_u2_msc_capacity_cb(uint32_t *blocks);
+bool usb_u2_msc_read_cb(uint32_t lba, uint16_t offset, uint8_t *b, uint8_t len);
+bool usb_u2_msc_write_cb(uint32_t lba, uint16_t offset, const uint8_t *b, uint8_t len);
+bool usb_u2_msc_ready_cb(void) __attribute__((weak));
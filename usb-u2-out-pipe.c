@@ -0,0 +1,126 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * Flow controlled OUT endpoints.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+#include "usb-u2-out-pipe.h"
+
+// series 2 don't have more than 5 endpoints (including 0)
+static usb_u2_out_pipe_t *pipes[4];
+
+
+static void
+handler(uint8_t ep)
+{
+    // runs from USB_COM_vect with the endpoint selected
+    usb_u2_out_pipe_t *p = pipes[ep - 1];
+    if (p == NULL)
+        return;
+
+    uint8_t eps = 8 << ((UECFG1X >> EPSIZE0) & 0x07);
+
+    // with double banking the other bank may be ready as soon as one is
+    // released, so keep going while there is room. otherwise the packet stays
+    // in the bank, and the interrupt is parked until usb_u2_out_pipe_read()
+    // frees some room.
+    while ((UEINTX & (1 << RXOUTI)) != 0 && p->size - p->count >= eps) {
+        uint8_t head = p->head;
+        uint8_t n = 0;
+
+        while ((UEINTX & (1 << RWAL)) != 0) {
+            p->b[head] = UEDATX;
+            if (++head == p->size)
+                head = 0;
+            n++;
+        }
+
+        UEINTX &= ~((1 << RXOUTI) | (1 << FIFOCON));
+
+        p->head = head;
+        p->count += n;
+    }
+
+    if (!p->above_high_water && p->count >= p->high_water) {
+        p->above_high_water = true;
+        if (usb_u2_out_pipe_high_water_cb != NULL)
+            usb_u2_out_pipe_high_water_cb(p);
+    }
+}
+
+
+bool
+usb_u2_out_pipe_init(usb_u2_out_pipe_t *p, uint8_t ep, uint8_t *b, uint8_t size,
+    uint8_t low_water, uint8_t high_water)
+{
+    if (p == NULL || b == NULL || ep == 0 || ep > 4 || low_water > high_water)
+        return false;
+
+    p->ep = ep;
+    p->b = b;
+    p->size = size;
+    p->low_water = low_water;
+    p->high_water = high_water;
+    p->head = 0;
+    p->tail = 0;
+    p->count = 0;
+    p->above_high_water = false;
+
+    pipes[ep - 1] = p;
+    return usb_u2_endpoint_register(ep, handler);
+}
+
+
+uint8_t
+usb_u2_out_pipe_available(const usb_u2_out_pipe_t *p)
+{
+    return p->count;
+}
+
+
+uint8_t
+usb_u2_out_pipe_read(usb_u2_out_pipe_t *p, uint8_t *data, uint8_t len)
+{
+    if (p == NULL || data == NULL)
+        return 0;
+
+    uint8_t count = p->count;
+    uint8_t tail = p->tail;
+    uint8_t n = 0;
+
+    while (n < len && n < count) {
+        data[n++] = p->b[tail];
+        if (++tail == p->size)
+            tail = 0;
+    }
+
+    if (n == 0)
+        return 0;
+
+    p->tail = tail;
+
+    bool low = false;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        p->count -= n;
+        if (p->above_high_water && p->count <= p->low_water) {
+            p->above_high_water = false;
+            low = true;
+        }
+    }
+
+    if (low && usb_u2_out_pipe_low_water_cb != NULL)
+        usb_u2_out_pipe_low_water_cb(p);
+
+    // a parked packet may fit now
+    usb_u2_endpoint_resume(p->ep);
+
+    return n;
+}
@@ -0,0 +1,48 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * Flow controlled OUT endpoints.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "usb-u2.h"
+
+#ifndef USB_U2_ENDPOINT_HANDLERS
+#error "this driver requires USB_U2_ENDPOINT_HANDLERS"
+#endif
+
+
+// Pipe types
+
+// a pipe moves OUT packets into a ring buffer owned by the caller. a packet
+// is only taken from the fifo when the ring has room for a full packet,
+// otherwise the bank stays busy and the host is NAKed.
+typedef struct {
+    uint8_t           ep;
+    uint8_t           *b;
+    uint8_t           size;
+    uint8_t           low_water;
+    uint8_t           high_water;
+    uint8_t           head;
+    uint8_t           tail;
+    volatile uint8_t  count;
+    volatile bool     above_high_water;
+} usb_u2_out_pipe_t;
+
+
+// Library API
+bool usb_u2_out_pipe_init(usb_u2_out_pipe_t *p, uint8_t ep, uint8_t *b, uint8_t size,
+    uint8_t low_water, uint8_t high_water);
+uint8_t usb_u2_out_pipe_available(const usb_u2_out_pipe_t *p);
+uint8_t usb_u2_out_pipe_read(usb_u2_out_pipe_t *p, uint8_t *data, uint8_t len);
+
+
+// Callbacks
+void usb_u2_out_pipe_high_water_cb(usb_u2_out_pipe_t *p) __attribute__((weak));  // from USB_COM_vect
+void usb_u2_out_pipe_low_water_cb(usb_u2_out_pipe_t *p) __attribute__((weak));
@@ -0,0 +1,171 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * Asynchronous endpoint transfers.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <avr/io.h>
+#include <avr/pgmspace.h>
+#include <util/atomic.h>
+#include "usb-u2-transfer.h"
+
+// series 2 don't have more than 5 endpoints (including 0)
+static usb_u2_transfer_t *volatile queue_head[4];
+static usb_u2_transfer_t *volatile queue_tail[4];
+static usb_u2_transfer_t *volatile done_head = NULL;
+static usb_u2_transfer_t *volatile done_tail = NULL;
+static bool out_partial[4];
+static bool out_short[4];
+
+
+static void
+complete(usb_u2_transfer_t *t, uint8_t status)
+{
+    t->status = status;
+    t->next = NULL;
+
+    if (done_tail == NULL)
+        done_head = t;
+    else
+        done_tail->next = t;
+    done_tail = t;
+}
+
+
+static bool
+advance_in(usb_u2_transfer_t *t)
+{
+    uint16_t actual = t->actual;
+    while (actual < t->len && (UEINTX & (1 << RWAL)) != 0) {
+        UEDATX = (t->flags & USB_U2_TRANSFER_FLAG_PROGMEM) ? pgm_read_byte(&(t->b[actual])) : t->b[actual];
+        actual++;
+    }
+    t->actual = actual;
+
+    // a full bank ending the transfer still needs a zlp afterwards, if asked to
+    bool full = (UEINTX & (1 << RWAL)) == 0;
+    UEINTX &= ~((1 << TXINI) | (1 << FIFOCON));
+
+    return actual == t->len && !(full && (t->flags & USB_U2_TRANSFER_FLAG_ZLP));
+}
+
+
+static bool
+advance_out(usb_u2_transfer_t *t)
+{
+    uint8_t i = t->ep - 1;
+    uint8_t avail = UEBCLX;
+
+    // a bank partly read by a previous transfer keeps the size of the packet
+    // as received, not of what is left of it.
+    if (!out_partial[i])
+        out_short[i] = avail < (8 << ((UECFG1X >> EPSIZE0) & 0x07));
+
+    uint16_t actual = t->actual;
+    while (avail > 0 && actual < t->len) {
+        t->b[actual++] = UEDATX;
+        avail--;
+    }
+    t->actual = actual;
+
+    // bytes that don't fit this transfer stay in the bank for the next one
+    out_partial[i] = avail != 0;
+    if (avail == 0)
+        UEINTX &= ~((1 << RXOUTI) | (1 << FIFOCON));
+
+    return actual == t->len || out_short[i];
+}
+
+
+static void
+handler(uint8_t ep)
+{
+    // runs from USB_COM_vect with the endpoint selected. every pass releases
+    // a bank or completes a transfer. with double banking the other bank may
+    // be ready right away, and returning with it ready would park the
+    // interrupt.
+    bool in = (UECFG0X & (1 << EPDIR)) != 0;
+    uint8_t ready = in ? (1 << TXINI) : (1 << RXOUTI);
+
+    while (queue_head[ep - 1] != NULL && (UEINTX & ready) != 0) {
+        usb_u2_transfer_t *t = queue_head[ep - 1];
+
+        if (!(in ? advance_in(t) : advance_out(t)))
+            continue;
+
+        queue_head[ep - 1] = t->next;
+        if (queue_head[ep - 1] == NULL)
+            queue_tail[ep - 1] = NULL;
+
+        complete(t, USB_U2_TRANSFER_STATUS_DONE);
+    }
+}
+
+
+bool
+usb_u2_transfer_submit(usb_u2_transfer_t *t)
+{
+    // series 2 don't have more than 5 endpoints (including 0)
+    if (t == NULL || t->ep == 0 || t->ep > 4 || (t->b == NULL && t->len > 0))
+        return false;
+
+    t->actual = 0;
+    t->status = USB_U2_TRANSFER_STATUS_PENDING;
+    t->next = NULL;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        if (queue_tail[t->ep - 1] == NULL) {
+            queue_head[t->ep - 1] = t;
+            usb_u2_endpoint_register(t->ep, handler);
+        }
+        else {
+            queue_tail[t->ep - 1]->next = t;
+        }
+        queue_tail[t->ep - 1] = t;
+    }
+
+    return true;
+}
+
+
+usb_u2_transfer_t*
+usb_u2_transfer_reap(void)
+{
+    usb_u2_transfer_t *rv;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        rv = done_head;
+        if (rv != NULL) {
+            done_head = rv->next;
+            if (done_head == NULL)
+                done_tail = NULL;
+        }
+    }
+
+    return rv;
+}
+
+
+void
+usb_u2_transfer_cancel(uint8_t ep)
+{
+    if (ep == 0 || ep > 4)
+        return;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        usb_u2_transfer_t *t = queue_head[ep - 1];
+        queue_head[ep - 1] = NULL;
+        queue_tail[ep - 1] = NULL;
+
+        while (t != NULL) {
+            usb_u2_transfer_t *next = t->next;
+            complete(t, USB_U2_TRANSFER_STATUS_CANCELLED);
+            t = next;
+        }
+    }
+}
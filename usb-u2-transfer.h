@@ -0,0 +1,49 @@
+/*
+ * usb-u2: A bare minimum USB stack for atmega{8,16,32}u2.
+ *
+ * Asynchronous endpoint transfers.
+ *
+ * SPDX-FileCopyrightText: 2021-2022 Rafael G. Martins <rafael@rafaelmartins.eng.br>
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "usb-u2.h"
+
+#ifndef USB_U2_ENDPOINT_HANDLERS
+#error "this driver requires USB_U2_ENDPOINT_HANDLERS"
+#endif
+
+
+// Transfer macros
+
+#define USB_U2_TRANSFER_FLAG_PROGMEM    (1 << 0)  // IN data is read from flash
+#define USB_U2_TRANSFER_FLAG_ZLP        (1 << 1)  // end IN transfer with zlp if needed
+
+#define USB_U2_TRANSFER_STATUS_PENDING      0
+#define USB_U2_TRANSFER_STATUS_DONE         1
+#define USB_U2_TRANSFER_STATUS_CANCELLED    2
+
+
+// Transfer types
+
+// descriptors are owned by the caller and must stay valid until reaped.
+// OUT transfers end when the buffer is full or a short packet is received.
+typedef struct usb_u2_transfer {
+    uint8_t                 ep;
+    uint8_t                 flags;
+    uint8_t                 *b;
+    uint16_t                len;
+    volatile uint16_t       actual;
+    volatile uint8_t        status;
+    struct usb_u2_transfer  *next;
+} usb_u2_transfer_t;
+
+
+// Library API
+bool usb_u2_transfer_submit(usb_u2_transfer_t *t);
+usb_u2_transfer_t* usb_u2_transfer_reap(void);
+void usb_u2_transfer_cancel(uint8_t ep);
@@ -16,10 +16,49 @@
 static volatile uint8_t config;
 static volatile uint8_t num_configs;
 static volatile uint8_t epmax;
+static uint8_t double_banks;  // bit per endpoint, kept to rebuild endpoints
 static volatile uint8_t ep0size;
 static volatile uint8_t state = USB_U2_STATE_DEFAULT;
+static volatile bool deferred = false;
+static bool aborted = false;
 static usb_u2_control_request_t req;
 
+// series 2 don't have more than 5 endpoints (including 0)
+static usb_u2_control_handler_t class_interfaces[USB_U2_MAX_INTERFACES];
+static uint8_t alt_settings[USB_U2_MAX_INTERFACES];
+static usb_u2_control_handler_t class_endpoints[5];
+
+#ifdef USB_U2_ENDPOINT_HANDLERS
+static usb_u2_endpoint_handler_t endpoint_handlers[4];
+#endif
+
+#ifdef USB_U2_DEFER_RESET_HOOK
+static volatile bool reset_hook_pending = false;
+#endif
+
+#ifdef USB_U2_ISR_TIMING
+static volatile uint16_t isr_gen_max = 0;
+static volatile uint16_t isr_com_max = 0;
+
+// timer1 ticks spent between isr body entry and exit. prologue and epilogue
+// are not included.
+#define ISR_TIMING_BEGIN()  uint16_t isr_start = TCNT1
+#define ISR_TIMING_END(max) do {                \
+    uint16_t isr_ticks = TCNT1 - isr_start;     \
+    if (isr_ticks > max)                        \
+        max = isr_ticks;                        \
+} while (0)
+#else
+#define ISR_TIMING_BEGIN()
+#define ISR_TIMING_END(max)
+#endif
+
+#ifdef USB_U2_ENUM_PROFILE
+static volatile uint16_t enum_ms = 0;
+static volatile bool enum_setup_seen = false;
+static usb_u2_enum_stage_t enum_stages[USB_U2_ENUM_STAGES];
+#endif
+
 static const usb_u2_string_descriptor_t default_enus_lang PROGMEM = {
     .bLength = 4,
     .bDescriptorType = USB_U2_DESCR_TYPE_STRING,
@@ -55,20 +94,38 @@ usb_u2_init(void)
     PLLCSR |= (1 << PLLE);
     while (!(PLLCSR & (1 << PLOCK)));
 
+#if defined(USB_U2_ISR_TIMING) || defined(USB_U2_ENUM_PROFILE)
+    // timer1 may be already running for the application, otherwise run it
+    // without prescaler, so that ticks are cpu cycles
+    if ((TCCR1B & ((1 << CS12) | (1 << CS11) | (1 << CS10))) == 0)
+        TCCR1B |= (1 << CS10);
+#endif
+
     // enable interrupt
     // FIXME: handle suspend
     UDIEN = (1 << EORSTE);
 
+#ifdef USB_U2_ENUM_PROFILE
+    // SOF interrupts give wall time in ms
+    UDIEN |= (1 << SOFE);
+#endif
+
     // attach usb
     UDCON &= ~(1 << DETACH);
 }
 
 
-ISR(USB_GEN_vect)
+static void
+reset_alt_settings(void)
 {
-    if ((UDINT & (1 << EORSTI)) == 0)
-        return;
+    for (uint8_t i = 0; i < USB_U2_MAX_INTERFACES; i++)
+        alt_settings[i] = 0;
+}
 
+
+static void
+handle_reset(void)
+{
     // ack interrupt
     UDINT &= ~(1 << EORSTI);
 
@@ -80,6 +137,10 @@ ISR(USB_GEN_vect)
     ep0size = pgm_read_byte(&(desc->bMaxPacketSize0));
     num_configs = pgm_read_byte(&(desc->bNumConfigurations));
 
+    // the main loop may be in the middle of filling some endpoint fifo, keep
+    // its selection
+    uint8_t uenum = UENUM;
+
     UENUM = 0;
     UECONX |= (1 << EPEN);
     UECFG0X = 0;
@@ -90,20 +151,201 @@ ISR(USB_GEN_vect)
 
     config = 0;
     epmax = 0;
+    deferred = false;
+    reset_alt_settings();
+
+#ifdef USB_U2_ENUM_PROFILE
+    enum_ms = 0;
+    enum_setup_seen = false;
+    for (uint8_t i = 0; i < USB_U2_ENUM_STAGES; i++) {
+        enum_stages[i].cycles = 0;
+        enum_stages[i].end_ms = 0;
+        enum_stages[i].requests = 0;
+    }
+#endif
 
+#ifdef USB_U2_DEFER_RESET_HOOK
+    // called from usb_u2_task(), with interrupts enabled
+    reset_hook_pending = true;
+#else
     if (usb_u2_reset_hook_cb != NULL)
         usb_u2_reset_hook_cb();
+#endif
+
+    UENUM = uenum;
 }
 
 
-uint8_t
-usb_u2_control_in(const uint8_t *b, size_t len, bool from_progmem)
+ISR(USB_GEN_vect)
 {
-    UENUM = 0;
+    ISR_TIMING_BEGIN();
+
+#ifdef USB_U2_ENUM_PROFILE
+    if ((UDINT & (1 << SOFI)) != 0) {
+        UDINT &= ~(1 << SOFI);
+        enum_ms++;
+    }
+#endif
+
+    if ((UDINT & (1 << EORSTI)) != 0)
+        handle_reset();
+
+    ISR_TIMING_END(isr_gen_max);
+}
+
+
+static bool
+wait_for(uint8_t mask)
+{
+    // waits are bound by frames, as counted from SOF. if the bus goes quiet
+    // (no SOF), a long enough spin counts as a frame as well.
+    uint8_t frame = UDFNUML;
+    uint8_t frames = 0;
+    uint16_t spins = 0;
+
+    while ((UEINTX & mask) == 0) {
+        // a new setup aborts current transfer, and is left for usb_u2_task()
+        if ((UEINTX & (1 << RXSTPI)) != 0) {
+            aborted = true;
+            return false;
+        }
+
+        if (UDFNUML != frame || ++spins == 0) {
+            frame = UDFNUML;
+            spins = 0;
+            if (++frames >= USB_U2_CONTROL_TIMEOUT_FRAMES)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+
+static bool
+wait_in(void)
+{
+    // host may end a control read early by sending the status stage, which
+    // completes the transfer, so there is nothing else to send.
+    if (!wait_for((1 << TXINI) | (1 << RXOUTI)))
+        return false;
+
+    if ((UEINTX & (1 << RXOUTI)) != 0) {
+        UEINTX &= ~(1 << RXOUTI);
+        return false;
+    }
+
+    return true;
+}
+
+
+static bool
+setup_ack(void)
+{
+    // a deferred request had its setup acked already, unless a new setup
+    // arrived in the meantime, which cancels it.
+    if (deferred) {
+        deferred = false;
+        return (UEINTX & (1 << RXSTPI)) == 0;
+    }
 
     if ((UEINTX & (1 << RXSTPI)) == 0)
-        return 0;
+        return false;
+
     UEINTX &= ~(1 << RXSTPI);
+    return true;
+}
+
+
+void
+usb_u2_control_defer(void)
+{
+    uint8_t uenum = UENUM;
+    UENUM = 0;
+
+    // ack the setup without touching the data or status stage banks, so that
+    // the controller NAKs the host until the request is completed with one of
+    // the usb_u2_control_* functions from the main loop.
+    if (!deferred && (UEINTX & (1 << RXSTPI)) != 0) {
+        UEINTX &= ~(1 << RXSTPI);
+        deferred = true;
+    }
+
+    UENUM = uenum;
+}
+
+
+const usb_u2_control_request_t*
+usb_u2_control_deferred_request(void)
+{
+    uint8_t uenum = UENUM;
+    UENUM = 0;
+
+    if (deferred && (UEINTX & (1 << RXSTPI)) != 0)
+        deferred = false;
+
+    UENUM = uenum;
+    return deferred ? &req : NULL;
+}
+
+
+#ifdef USB_U2_ENDPOINT_HANDLERS
+ISR(USB_COM_vect)
+{
+    ISR_TIMING_BEGIN();
+
+    uint8_t uenum = UENUM;
+    uint8_t epint = UEINT;
+
+    for (uint8_t ep = 1; ep <= 4; ep++) {
+        if ((epint & (1 << ep)) == 0 || endpoint_handlers[ep - 1] == NULL)
+            continue;
+
+        UENUM = ep;
+        endpoint_handlers[ep - 1](ep);
+
+        // the handler had nothing to do, park the interrupt until
+        // usb_u2_endpoint_resume(), otherwise it would fire again right away.
+        if ((UEINTX & UEIENX & ((1 << TXINI) | (1 << RXOUTI))) != 0)
+            UEIENX &= ~((1 << TXINE) | (1 << RXOUTE));
+    }
+
+    UENUM = uenum;
+
+    ISR_TIMING_END(isr_com_max);
+}
+#endif
+
+
+#ifdef USB_U2_ISR_TIMING
+void
+usb_u2_isr_timing(usb_u2_isr_timing_t *t, bool reset)
+{
+    if (t == NULL)
+        return;
+
+    uint8_t sreg = SREG;
+    cli();
+
+    t->gen_max_ticks = isr_gen_max;
+    t->com_max_ticks = isr_com_max;
+    if (reset) {
+        isr_gen_max = 0;
+        isr_com_max = 0;
+    }
+
+    SREG = sreg;
+}
+#endif
+
+
+static uint8_t
+control_in(const uint8_t *b, size_t len, bool from_progmem)
+{
+    UENUM = 0;
+
+    if (!setup_ack())
+        return 0;
 
     // DATA STAGE
 
@@ -122,7 +364,8 @@ usb_u2_control_in(const uint8_t *b, size_t len, bool from_progmem)
     uint8_t i = 0;
 
     while (len > 0) {
-        while ((UEINTX & (1 << TXINI)) == 0);
+        if (!wait_in())
+            return i;
 
         while (len > 0 && UEBCLX < ep0size) {
             UEDATX = from_progmem ? pgm_read_byte(&(b[i++])) : b[i++];
@@ -133,13 +376,15 @@ usb_u2_control_in(const uint8_t *b, size_t len, bool from_progmem)
     }
 
     if (with_zlp) {
-        while ((UEINTX & (1 << TXINI)) == 0);
+        if (!wait_in())
+            return i;
         UEINTX &= ~(1 << TXINI);
     }
 
     // STATUS STAGE
 
-    while ((UEINTX & (1 << RXOUTI)) == 0);
+    if (!wait_for(1 << RXOUTI))
+        return i;
     UEINTX &= ~(1 << RXOUTI);
 
     return i;
@@ -147,13 +392,22 @@ usb_u2_control_in(const uint8_t *b, size_t len, bool from_progmem)
 
 
 uint8_t
-usb_u2_control_out(uint8_t *b, size_t len)
+usb_u2_control_in(const uint8_t *b, size_t len, bool from_progmem)
+{
+    uint8_t uenum = UENUM;
+    uint8_t rv = control_in(b, len, from_progmem);
+    UENUM = uenum;
+    return rv;
+}
+
+
+static uint8_t
+control_out(uint8_t *b, size_t len)
 {
     UENUM = 0;
 
-    if ((UEINTX & (1 << RXSTPI)) == 0)
+    if (!setup_ack())
         return 0;
-    UEINTX &= ~(1 << RXSTPI);
 
     // DATA STAGE
 
@@ -167,7 +421,8 @@ usb_u2_control_out(uint8_t *b, size_t len)
     uint8_t i = 0;
 
     while (len > 0) {
-        while ((UEINTX & (1 << RXOUTI)) == 0);
+        if (!wait_for(1 << RXOUTI))
+            return i;
 
         while (len > 0 && UEBCLX > 0) {
             b[i++] = UEDATX;
@@ -177,14 +432,80 @@ usb_u2_control_out(uint8_t *b, size_t len)
         UEINTX &= ~(1 << RXOUTI);
     }
 
-    while ((UEINTX & (1 << TXINI)) == 0);
+    wait_for(1 << TXINI);
 
     return i;
 }
 
 
-void
-usb_u2_control_out_status(void)
+uint8_t
+usb_u2_control_out(uint8_t *b, size_t len)
+{
+    uint8_t uenum = UENUM;
+    uint8_t rv = control_out(b, len);
+    UENUM = uenum;
+    return rv;
+}
+
+
+static uint16_t
+control_out_stream(usb_u2_control_out_consumer_t consumer)
+{
+    UENUM = 0;
+
+    if (consumer == NULL || !setup_ack())
+        return 0;
+
+    // DATA STAGE
+
+    // each packet is handed to the consumer as soon as it arrives, and the
+    // bank is only released after the consumer returns, so that the host is
+    // NAKed while the consumer works. data stage size is bound by wLength
+    // only, and no ram is used to buffer packets.
+    uint16_t offset = 0;
+
+    while (offset < req.wLength) {
+        if (!wait_for(1 << RXOUTI))
+            return offset;
+
+        // the consumer reads the packet straight from the fifo (UEDATX),
+        // with endpoint 0 selected. bytes left unread are discarded.
+        uint8_t len = UEBCLX;
+
+        if (!consumer(len, offset)) {
+            // consumer gave up, stall the rest of the transfer. caller must
+            // not call usb_u2_control_out_status().
+            UECONX |= (1 << STALLRQ);
+            UEINTX &= ~(1 << RXOUTI);
+            return offset;
+        }
+
+        UEINTX &= ~(1 << RXOUTI);
+        offset += len;
+
+        // short packet ends data stage
+        if (len < ep0size)
+            break;
+    }
+
+    wait_for(1 << TXINI);
+
+    return offset;
+}
+
+
+uint16_t
+usb_u2_control_out_stream(usb_u2_control_out_consumer_t consumer)
+{
+    uint8_t uenum = UENUM;
+    uint16_t rv = control_out_stream(consumer);
+    UENUM = uenum;
+    return rv;
+}
+
+
+static void
+control_out_status(void)
 {
     UENUM = 0;
 
@@ -192,8 +513,61 @@ usb_u2_control_out_status(void)
         return;
 
     UEINTX &= ~(1 << TXINI);
-    while ((UEINTX & (1 << TXINI)) == 0);
+    wait_for(1 << TXINI);
+}
+
+
+void
+usb_u2_control_out_status(void)
+{
+    uint8_t uenum = UENUM;
+    control_out_status();
+    UENUM = uenum;
+}
+
+
+#ifdef USB_U2_ENDPOINT_HANDLERS
+static void
+endpoint_interrupt_enable(void)
+{
+    // IN endpoints get an interrupt when a bank is free, OUT endpoints when
+    // a packet is received.
+    UEIENX = ((UECFG0X & (1 << EPDIR)) != 0) ? (1 << TXINE) : (1 << RXOUTE);
+}
+
+
+bool
+usb_u2_endpoint_register(uint8_t ep, usb_u2_endpoint_handler_t handler)
+{
+    // series 2 don't have more than 5 endpoints (including 0)
+    if (ep == 0 || ep > 4)
+        return false;
+
+    uint8_t uenum = UENUM;
+    UENUM = ep;
+
+    UEIENX = 0;
+    endpoint_handlers[ep - 1] = handler;
+    if (handler != NULL && (UECONX & (1 << EPEN)) != 0)
+        endpoint_interrupt_enable();
+
+    UENUM = uenum;
+    return true;
+}
+
+
+void
+usb_u2_endpoint_resume(uint8_t ep)
+{
+    if (ep == 0 || ep > 4 || endpoint_handlers[ep - 1] == NULL)
+        return;
+
+    uint8_t uenum = UENUM;
+    UENUM = ep;
+    endpoint_interrupt_enable();
+    UENUM = uenum;
 }
+#endif
 
 
 void
@@ -233,6 +607,38 @@ usb_u2_endpoint_in(const uint8_t *b, size_t len)
 }
 
 
+uint16_t
+usb_u2_endpoint_in_iov(const usb_u2_iovec_t *iov, uint8_t iovcnt)
+{
+    if (iov == NULL || (UEINTX & (1 << TXINI)) == 0)
+        return 0;
+
+    uint16_t total = 0;
+
+    // segments are written straight to the fifo. whenever the bank fills up
+    // it is released and we wait for the next one, so packet boundaries can
+    // fall anywhere inside a segment.
+    for (uint8_t s = 0; s < iovcnt; s++) {
+        for (uint16_t i = 0; i < iov[s].len; i++) {
+            if ((UEINTX & (1 << RWAL)) == 0) {
+                UEINTX &= ~((1 << TXINI) | (1 << FIFOCON));
+                if (!wait_for(1 << TXINI))
+                    return total;
+            }
+
+            UEDATX = iov[s].from_progmem ? pgm_read_byte(&(iov[s].b[i])) : iov[s].b[i];
+            total++;
+        }
+    }
+
+    // banks are only released when we need room, so the last one is always
+    // pending here. an empty list sends a zlp, as usb_u2_endpoint_in() does.
+    UEINTX &= ~((1 << TXINI) | (1 << FIFOCON));
+
+    return total;
+}
+
+
 bool
 usb_u2_endpoint_out_received(void)
 {
@@ -240,6 +646,36 @@ usb_u2_endpoint_out_received(void)
 }
 
 
+uint8_t
+usb_u2_endpoint_out_length(void)
+{
+    if ((UEINTX & (1 << RXOUTI)) == 0)
+        return 0;
+
+    return UEBCLX;
+}
+
+
+uint8_t
+usb_u2_endpoint_out_partial(uint8_t *data, uint8_t len)
+{
+    if (data == NULL || (UEINTX & (1 << RXOUTI)) == 0)
+        return 0;
+
+    uint8_t i = 0;
+
+    while (i < len && (UEINTX & (1 << RWAL)) != 0)
+        data[i++] = UEDATX;
+
+    // bank is kept until every byte is read, so the rest of the packet can
+    // go straight to its final destination in a later call.
+    if ((UEINTX & (1 << RWAL)) == 0)
+        UEINTX &= ~((1 << RXOUTI) | (1 << FIFOCON));
+
+    return i;
+}
+
+
 uint8_t
 usb_u2_endpoint_out(uint8_t *data, uint8_t len)
 {
@@ -266,9 +702,448 @@ usb_u2_endpoint_out(uint8_t *data, uint8_t len)
 }
 
 
+static bool
+control_in_put(uint8_t b, uint16_t *left)
+{
+    // banks are released lazily, when the next byte does not fit anymore
+    if (UEBCLX >= ep0size) {
+        UEINTX &= ~(1 << TXINI);
+        if (!wait_in())
+            return false;
+    }
+
+    UEDATX = b;
+    (*left)--;
+    return true;
+}
+
+
+static bool
+control_in_string_begin(uint8_t len, uint16_t *left)
+{
+    if (!setup_ack() || !wait_in())
+        return false;
+
+    if (*left > 0 && !control_in_put(len, left))
+        return false;
+
+    return *left == 0 || control_in_put(USB_U2_DESCR_TYPE_STRING, left);
+}
+
+
+static void
+control_in_string_end(uint8_t len)
+{
+    UEINTX &= ~(1 << TXINI);
+
+    // same rules as usb_u2_control_in()
+    if ((req.wLength > len) && (len % ep0size == 0)) {
+        if (!wait_in())
+            return;
+        UEINTX &= ~(1 << TXINI);
+    }
+
+    if (!wait_for(1 << RXOUTI))
+        return;
+    UEINTX &= ~(1 << RXOUTI);
+}
+
+
+static void
+control_in_utf8(const char *s)
+{
+    // string descriptors are limited to 126 UTF-16 code units by bLength
+    uint8_t units = 0;
+    for (const char *p = s; units < 126; p++) {
+        uint8_t c = pgm_read_byte(p);
+        if (c == 0)
+            break;
+        if ((c & 0xc0) != 0x80)
+            units++;
+    }
+
+    uint8_t len = 2 + 2 * units;
+    uint16_t left = req.wLength < len ? req.wLength : len;
+    if (!control_in_string_begin(len, &left))
+        return;
+
+    // expand to UTF-16LE while writing to fifo. code points outside BMP are
+    // replaced by U+FFFD.
+    const char *p = s;
+    while (left > 0 && units > 0) {
+        // stray continuation bytes were not counted as units
+        while ((pgm_read_byte(p) & 0xc0) == 0x80)
+            p++;
+
+        uint16_t cp = pgm_read_byte(p++);
+        uint8_t cont = 0;
+
+        if ((cp & 0xe0) == 0xc0) {
+            cp &= 0x1f;
+            cont = 1;
+        }
+        else if ((cp & 0xf0) == 0xe0) {
+            cp &= 0x0f;
+            cont = 2;
+        }
+        else if (cp >= 0x80) {
+            cp = 0xfffd;
+        }
+
+        while ((pgm_read_byte(p) & 0xc0) == 0x80) {
+            if (cont > 0) {
+                cp = (cp << 6) | (pgm_read_byte(p) & 0x3f);
+                cont--;
+            }
+            p++;
+        }
+
+        if (!control_in_put(cp, &left))
+            return;
+        if (left > 0 && !control_in_put(cp >> 8, &left))
+            return;
+        units--;
+    }
+
+    control_in_string_end(len);
+}
+
+
+static void
+control_in_langids(void)
+{
+    uint8_t n = pgm_read_byte(&usb_u2_string_languages_len);
+    if (n > 126)
+        n = 126;
+
+    uint8_t len = 2 + 2 * n;
+    uint16_t left = req.wLength < len ? req.wLength : len;
+    if (!control_in_string_begin(len, &left))
+        return;
+
+    for (uint8_t i = 0; left > 0 && i < n; i++) {
+        uint16_t langid = pgm_read_word(&(usb_u2_string_languages[i].langid));
+        if (!control_in_put(langid, &left))
+            return;
+        if (left > 0 && !control_in_put(langid >> 8, &left))
+            return;
+    }
+
+    control_in_string_end(len);
+}
+
+
+static const char*
+string_lookup(uint8_t string_id, uint16_t lang_id)
+{
+    if (string_id == 0)
+        return NULL;
+
+    // languages are sorted by langid
+    uint8_t lo = 0;
+    uint8_t hi = pgm_read_byte(&usb_u2_string_languages_len);
+
+    while (lo < hi) {
+        uint8_t mid = (lo + hi) / 2;
+        const usb_u2_string_language_t *l = &usb_u2_string_languages[mid];
+        uint16_t langid = pgm_read_word(&(l->langid));
+
+        if (langid < lang_id) {
+            lo = mid + 1;
+        }
+        else if (langid > lang_id) {
+            hi = mid;
+        }
+        else {
+            if (string_id > pgm_read_byte(&(l->num_strings)))
+                return NULL;
+            const char* const *strings = pgm_read_ptr(&(l->strings));
+            return pgm_read_ptr(&(strings[string_id - 1]));
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+control_in_serial(void)
+{
+    UEINTX &= ~(1 << RXSTPI);
+    if (!wait_in())
+        return;
+
+    UEDATX = 2 + (0x18 - 0x0e) * 4;
+    UEDATX = USB_U2_DESCR_TYPE_STRING;
+
+    // address range info from datasheet pag 236, table 23-6
+    for (uint8_t a = 0x0e; a < 0x18; a++) {
+        uint8_t b = boot_signature_byte_get(a);
+        UEDATX = (b >> 4) > 9 ? (b >> 4) - 10 + 'a' : (b >> 4) + '0';
+        UEDATX = 0;
+
+        // here we have the number of sent bytes as multiple of 8,
+        // that could be a IN packet boundary, lets check it.
+        if (UEBCLX >= ep0size) {
+            UEINTX &= ~(1 << TXINI);
+            if (!wait_in())
+                return;
+        }
+
+        UEDATX = (b & 0xf) > 9 ? (b & 0xf) - 10 + 'a' : (b & 0xf) + '0';
+        UEDATX = 0;
+    }
+
+    UEINTX &= ~(1 << TXINI);
+    if (!wait_for(1 << RXOUTI))
+        return;
+    UEINTX &= ~(1 << RXOUTI);
+}
+
+
+bool
+usb_u2_control_class_register(uint8_t rcpt, uint8_t index, usb_u2_control_handler_t handler)
+{
+    switch (rcpt) {
+        case USB_U2_REQ_RCPT_INTERFACE:
+            if (index >= USB_U2_MAX_INTERFACES)
+                return false;
+            class_interfaces[index] = handler;
+            return true;
+
+        case USB_U2_REQ_RCPT_ENDPOINT:
+            index &= 0xf;
+            if (index > 4)
+                return false;
+            class_endpoints[index] = handler;
+            return true;
+    }
+
+    return false;
+}
+
+
+static void
+handle_class(void)
+{
+    // handlers are looked up directly by the interface or endpoint number in
+    // wIndex, anything else goes to the generic callback.
+    usb_u2_control_handler_t handler = NULL;
+    uint8_t index = req.wIndex;
+
+    switch (req.bmRequestType & USB_U2_REQ_RCPT_MASK) {
+        case USB_U2_REQ_RCPT_INTERFACE:
+            if (index < USB_U2_MAX_INTERFACES)
+                handler = class_interfaces[index];
+            break;
+
+        case USB_U2_REQ_RCPT_ENDPOINT:
+            index &= 0xf;
+            if (index <= 4)
+                handler = class_endpoints[index];
+            break;
+    }
+
+    if (handler == NULL)
+        handler = usb_u2_control_class_cb;
+
+    if (handler != NULL)
+        handler(&req);
+}
+
+
+static void
+handle_vendor(void)
+{
+    if (&usb_u2_vendor_requests_len != NULL &&
+        req.bRequest < pgm_read_word(&usb_u2_vendor_requests_len)) {
+        const usb_u2_vendor_request_t *r = &usb_u2_vendor_requests[req.bRequest];
+
+        // holes in the table have a NULL handler
+        if ((pgm_read_byte(&(r->bRequest)) == req.bRequest) &&
+            (pgm_read_byte(&(r->direction)) == (req.bmRequestType & USB_U2_REQ_DIR_MASK))) {
+            usb_u2_control_handler_t handler = pgm_read_ptr(&(r->handler));
+            if (handler != NULL) {
+                handler(&req);
+                return;
+            }
+        }
+    }
+
+    if (usb_u2_control_vendor_cb != NULL)
+        usb_u2_control_vendor_cb(&req);
+}
+
+
+static const usb_u2_config_descriptor_t*
+find_config(uint8_t value)
+{
+    // bConfigurationValue is not required to match the descriptor index
+    for (uint8_t i = 0; i < num_configs; i++) {
+        const usb_u2_config_descriptor_t *cfg = usb_u2_config_descriptor_cb(i);
+        if (cfg != NULL && pgm_read_byte(&(cfg->bConfigurationValue)) == value)
+            return cfg;
+    }
+
+    return NULL;
+}
+
+
+static void
+free_endpoints(uint8_t first)
+{
+    uint8_t uenum = UENUM;
+
+    // dpram is allocated in endpoint order, so free it from the last one
+    for (uint8_t ep = 4; ep >= first; ep--) {
+        UENUM = ep;
+        UEIENX = 0;
+        UECONX &= ~(1 << EPEN);
+        UECFG1X &= ~(1 << ALLOC);
+    }
+
+    UENUM = uenum;
+    if (epmax >= first)
+        epmax = first - 1;
+}
+
+
+static const usb_u2_endpoint_descriptor_t*
+find_active_endpoint(const usb_u2_config_descriptor_t *cfg, uint8_t epnum)
+{
+    const uint8_t *p = (const uint8_t*) cfg;
+    const uint8_t *end = p + pgm_read_word(&(cfg->wTotalLength));
+    bool active = false;
+
+    for (uint8_t len; p < end && (len = pgm_read_byte(p)) != 0; p += len) {
+        switch (pgm_read_byte(p + 1)) {
+            case USB_U2_DESCR_TYPE_INTERFACE: {
+                const usb_u2_interface_descriptor_t *itf = (const void*) p;
+                uint8_t num = pgm_read_byte(&(itf->bInterfaceNumber));
+                uint8_t alt = (num < USB_U2_MAX_INTERFACES) ? alt_settings[num] : 0;
+                active = pgm_read_byte(&(itf->bAlternateSetting)) == alt;
+                break;
+            }
+
+            case USB_U2_DESCR_TYPE_ENDPOINT: {
+                const usb_u2_endpoint_descriptor_t *ep = (const void*) p;
+                if (active && (pgm_read_byte(&(ep->bEndpointAddress)) & 0xf) == epnum)
+                    return ep;
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+
+static bool
+find_interface(const usb_u2_config_descriptor_t *cfg, uint8_t iface, uint8_t alt, uint8_t *first_ep)
+{
+    const uint8_t *p = (const uint8_t*) cfg;
+    const uint8_t *end = p + pgm_read_word(&(cfg->wTotalLength));
+    bool found = false;
+    bool match = false;
+
+    // first_ep is the lowest endpoint used by any of the interface settings,
+    // everything below it is not affected when switching them.
+    *first_ep = 5;
+
+    for (uint8_t len; p < end && (len = pgm_read_byte(p)) != 0; p += len) {
+        switch (pgm_read_byte(p + 1)) {
+            case USB_U2_DESCR_TYPE_INTERFACE: {
+                const usb_u2_interface_descriptor_t *itf = (const void*) p;
+                match = pgm_read_byte(&(itf->bInterfaceNumber)) == iface;
+                if (match && pgm_read_byte(&(itf->bAlternateSetting)) == alt)
+                    found = true;
+                break;
+            }
+
+            case USB_U2_DESCR_TYPE_ENDPOINT: {
+                const usb_u2_endpoint_descriptor_t *ep = (const void*) p;
+                uint8_t epnum = pgm_read_byte(&(ep->bEndpointAddress)) & 0xf;
+                if (match && epnum != 0 && epnum < *first_ep)
+                    *first_ep = epnum;
+                break;
+            }
+        }
+    }
+
+    return found;
+}
+
+
+static bool
+endpoints_shared(const usb_u2_config_descriptor_t *cfg, uint8_t iface, uint8_t first_ep)
+{
+    const uint8_t *p = (const uint8_t*) cfg;
+    const uint8_t *end = p + pgm_read_word(&(cfg->wTotalLength));
+    bool other = false;
+
+    // looks for endpoints of other interfaces (in their active settings)
+    // that would be rebuilt together with the ones of iface.
+    for (uint8_t len; p < end && (len = pgm_read_byte(p)) != 0; p += len) {
+        switch (pgm_read_byte(p + 1)) {
+            case USB_U2_DESCR_TYPE_INTERFACE: {
+                const usb_u2_interface_descriptor_t *itf = (const void*) p;
+                uint8_t num = pgm_read_byte(&(itf->bInterfaceNumber));
+                uint8_t alt = (num < USB_U2_MAX_INTERFACES) ? alt_settings[num] : 0;
+                other = num != iface && pgm_read_byte(&(itf->bAlternateSetting)) == alt;
+                break;
+            }
+
+            case USB_U2_DESCR_TYPE_ENDPOINT: {
+                const usb_u2_endpoint_descriptor_t *ep = (const void*) p;
+                if (other && (pgm_read_byte(&(ep->bEndpointAddress)) & 0xf) >= first_ep)
+                    return true;
+                break;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+static bool
+rebuild_endpoints(const usb_u2_config_descriptor_t *cfg, uint8_t iface, uint8_t first_ep, uint8_t banks)
+{
+    // resizing an endpoint moves the dpram of every endpoint above it, so the
+    // interface endpoints are rebuilt from the descriptors of the active
+    // setting. endpoints below them keep running. an alternate setting
+    // without endpoints (e.g. the zero bandwidth alt 0 of isochronous
+    // interfaces) just frees them.
+    bool rv = true;
+
+    free_endpoints(first_ep);
+
+    for (uint8_t ep = first_ep; ep <= 4; ep++) {
+        const usb_u2_endpoint_descriptor_t *desc = find_active_endpoint(cfg, ep);
+        if (desc == NULL)
+            continue;
+
+        // endpoints keep the banks they were configured with, unless the
+        // application picks them for each setting.
+        bool double_bank = (banks & (1 << ep)) != 0;
+        if (usb_u2_interface_double_bank_cb != NULL)
+            double_bank = usb_u2_interface_double_bank_cb(iface, alt_settings[iface], ep);
+
+        if (!usb_u2_configure_endpoint_banks(desc, double_bank))
+            rv = false;
+    }
+
+    return rv;
+}
+
+
 static void
 handle_ctrl(void)
 {
+    // a new setup cancels any deferred request
+    deferred = false;
+    aborted = false;
+
     // read request beforehand to make sure we cleanup fifo
     uint8_t *tmp = (uint8_t*) &req;
     for (uint8_t i = 0; i < sizeof(usb_u2_control_request_t); i++)
@@ -278,9 +1153,12 @@ handle_ctrl(void)
         case USB_U2_REQ_TYPE_STANDARD:
             break;
 
+        case USB_U2_REQ_TYPE_CLASS:
+            handle_class();
+            goto _stall;
+
         case USB_U2_REQ_TYPE_VENDOR:
-            if (usb_u2_control_vendor_cb != NULL)
-                usb_u2_control_vendor_cb(&req);
+            handle_vendor();
 
         default:
             goto _stall;
@@ -311,9 +1189,31 @@ handle_ctrl(void)
             break;
         }
 
-        case USB_U2_REQ_CLEAR_FEATURE:  // FIXME: todo
-        case USB_U2_REQ_SET_FEATURE:    // FIXME: todo
+        case USB_U2_REQ_CLEAR_FEATURE:
+        case USB_U2_REQ_SET_FEATURE: {
+            // FIXME: handle remote wakeup and test mode
+            uint8_t ep = req.wIndex & 0xf;
+
+            // series 2 don't have more than 5 endpoints (including 0)
+            if (((req.bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST) ||
+                ((req.bmRequestType & USB_U2_REQ_RCPT_MASK) != USB_U2_REQ_RCPT_ENDPOINT) ||
+                (req.wValue != USB_U2_FEATURE_ENDPOINT_HALT) ||
+                (state != USB_U2_STATE_CONFIGURED) || (ep == 0) || (ep > 4))
+                break;
+
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+
+            // host resets its data toggle when clearing a halt, we must too
+            UENUM = ep;
+            if (req.bRequest == USB_U2_REQ_SET_FEATURE)
+                UECONX |= (1 << STALLRQ);
+            else
+                UECONX |= (1 << STALLRQC) | (1 << RSTDT);
+            UENUM = 0;
+
             break;
+        }
 
         case USB_U2_REQ_SET_ADDRESS: {
             if (((req.bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST) ||
@@ -347,52 +1247,53 @@ handle_ctrl(void)
                     break;
 
                 case USB_U2_DESCR_TYPE_CONFIGURATION:
-                    addr = usb_u2_config_descriptor_cb(config);
+                    // descriptor index is 0-based, while bConfigurationValue
+                    // used by SET_CONFIGURATION starts at 1
+                    if ((uint8_t) req.wValue >= num_configs)
+                        break;
+                    addr = usb_u2_config_descriptor_cb((uint8_t) req.wValue);
                     len_offset = 2;
                     break;
 
-                case USB_U2_DESCR_TYPE_STRING:
-                    addr = usb_u2_string_descriptor_cb(req.wValue, req.wIndex);
-                    if (addr != NULL)
+                case USB_U2_DESCR_TYPE_STRING: {
+                    if (usb_u2_string_descriptor_cb != NULL) {
+                        addr = usb_u2_string_descriptor_cb(req.wValue, req.wIndex);
+                        if (addr != NULL)
+                            break;
+                    }
+
+                    const char *str = NULL;
+                    if (usb_u2_string_cb != NULL)
+                        str = usb_u2_string_cb(req.wValue, req.wIndex);
+                    if (str == NULL && &usb_u2_string_languages_len != NULL) {
+                        if ((uint8_t) req.wValue == 0) {
+                            control_in_langids();
+                            break;
+                        }
+                        str = string_lookup(req.wValue, req.wIndex);
+                    }
+                    if (str != NULL) {
+                        control_in_utf8(str);
                         break;
+                    }
 
                     switch ((uint8_t) req.wValue) {
                         case 0:
                             addr = &default_enus_lang;
                             break;
 
-                        case USB_U2_DESCR_STR_IDX_SERIAL_INTERNAL: {
-                            UEINTX &= ~(1 << RXSTPI);
-                            while ((UEINTX & (1 << TXINI)) == 0);
-
-                            UEDATX = 2 + (0x18 - 0x0e) * 4;
-                            UEDATX = USB_U2_DESCR_TYPE_STRING;
-
-                            // address range info from datasheet pag 236, table 23-6
-                            for (uint8_t a = 0x0e; a < 0x18; a++) {
-                                uint8_t b = boot_signature_byte_get(a);
-                                UEDATX = (b >> 4) > 9 ? (b >> 4) - 10 + 'a' : (b >> 4) + '0';
-                                UEDATX = 0;
-
-                                // here we have the number of sent bytes as multiple of 8,
-                                // that could be a IN packet boundary, lets check it.
-                                if (UEBCLX >= ep0size) {
-                                    UEINTX &= ~(1 << TXINI);
-                                    while ((UEINTX & (1 << TXINI)) == 0);
-                                }
-
-                                UEDATX = (b & 0xf) > 9 ? (b & 0xf) - 10 + 'a' : (b & 0xf) + '0';
-                                UEDATX = 0;
-                            }
-
-                            UEINTX &= ~(1 << TXINI);
-                            while ((UEINTX & (1 << RXOUTI)) == 0);
-                            UEINTX &= ~(1 << RXOUTI);
-
-                            addr = NULL;
-                        }
+                        case USB_U2_DESCR_STR_IDX_SERIAL_INTERNAL:
+                            control_in_serial();
+                            break;
                     }
                     break;
+                }
+
+                default:
+                    // class specific descriptors (e.g. HID report) are requested from interfaces
+                    if ((req.bmRequestType & USB_U2_REQ_RCPT_MASK) == USB_U2_REQ_RCPT_INTERFACE)
+                        handle_class();
+                    break;
             }
 
             if (addr == NULL)
@@ -403,22 +1304,42 @@ handle_ctrl(void)
         }
 
         case USB_U2_REQ_SET_DESCRIPTOR:     // FIXME: todo
-        case USB_U2_REQ_GET_CONFIGURATION:  // FIXME: todo
             break;
 
+        case USB_U2_REQ_GET_CONFIGURATION: {
+            if (((req.bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_HOST_TO_DEVICE) ||
+                ((req.bmRequestType & USB_U2_REQ_RCPT_MASK) != USB_U2_REQ_RCPT_DEVICE) ||
+                (state == USB_U2_STATE_DEFAULT))
+                break;
+
+            uint8_t value = config;
+            usb_u2_control_in(&value, 1, false);
+            break;
+        }
+
         case USB_U2_REQ_SET_CONFIGURATION: {
             if (((req.bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST) ||
                 ((req.bmRequestType & USB_U2_REQ_RCPT_MASK) != USB_U2_REQ_RCPT_DEVICE) ||
-                (state != USB_U2_STATE_ADDRESS))
+                (state == USB_U2_STATE_DEFAULT))
                 break;
 
-            config = req.wValue;
-            if (config > num_configs)
+            if ((uint8_t) req.wValue != 0 && find_config(req.wValue) == NULL)
                 break;
 
             usb_u2_control_out(NULL, 0);
             usb_u2_control_out_status();
 
+            // each configuration has its own endpoint layout, drop the
+            // current one before building the new one
+            free_endpoints(1);
+            reset_alt_settings();
+            config = req.wValue;
+
+            if (config == 0) {
+                state = USB_U2_STATE_ADDRESS;
+                break;
+            }
+
             if (usb_u2_configure_endpoints_cb != NULL)
                 usb_u2_configure_endpoints_cb(config);
 
@@ -427,16 +1348,64 @@ handle_ctrl(void)
             break;
         }
 
-        case USB_U2_REQ_GET_INTERFACE:  // FIXME: todo
-        case USB_U2_REQ_SET_INTERFACE:  // FIXME: todo
+        case USB_U2_REQ_GET_INTERFACE: {
+            if (((req.bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_HOST_TO_DEVICE) ||
+                ((req.bmRequestType & USB_U2_REQ_RCPT_MASK) != USB_U2_REQ_RCPT_INTERFACE) ||
+                (state != USB_U2_STATE_CONFIGURED) || (req.wIndex >= USB_U2_MAX_INTERFACES))
+                break;
+
+            uint8_t alt = alt_settings[req.wIndex];
+            usb_u2_control_in(&alt, 1, false);
+            break;
+        }
+
+        case USB_U2_REQ_SET_INTERFACE: {
+            if (((req.bmRequestType & USB_U2_REQ_DIR_MASK) == USB_U2_REQ_DIR_DEVICE_TO_HOST) ||
+                ((req.bmRequestType & USB_U2_REQ_RCPT_MASK) != USB_U2_REQ_RCPT_INTERFACE) ||
+                (state != USB_U2_STATE_CONFIGURED) || (req.wIndex >= USB_U2_MAX_INTERFACES))
+                break;
+
+            const usb_u2_config_descriptor_t *cfg = find_config(config);
+            uint8_t first_ep;
+            if (cfg == NULL || !find_interface(cfg, req.wIndex, req.wValue, &first_ep))
+                break;
+
+            // rebuilding endpoints of other interfaces would wipe their fifos
+            // and data toggles behind the host's back, refuse instead.
+            if (first_ep <= 4 && endpoints_shared(cfg, req.wIndex, first_ep))
+                break;
+
+            uint8_t old_alt = alt_settings[req.wIndex];
+            uint8_t old_banks = double_banks;
+            alt_settings[req.wIndex] = req.wValue;
+
+            // the new layout must fit in dpram before host is told it is
+            // active. if it does not, the old one is rebuilt and the request
+            // is stalled.
+            if (first_ep <= 4 && !rebuild_endpoints(cfg, req.wIndex, first_ep, old_banks)) {
+                alt_settings[req.wIndex] = old_alt;
+                rebuild_endpoints(cfg, req.wIndex, first_ep, old_banks);
+                break;
+            }
+
+            usb_u2_control_out(NULL, 0);
+            usb_u2_control_out_status();
+
+            if (usb_u2_set_interface_hook_cb != NULL)
+                usb_u2_set_interface_hook_cb(req.wIndex, req.wValue);
+
+            break;
+        }
+
         case USB_U2_REQ_SYNCH_FRAME:    // FIXME: todo
             break;
     }
 
 _stall:
-    // interrupt not cleaned, stall ...
+    // interrupt not cleaned, stall ... unless it belongs to a new setup that
+    // aborted this one.
     UENUM = 0;
-    if (UEINTX & (1 << RXSTPI)) {
+    if (!aborted && (UEINTX & (1 << RXSTPI))) {
         UECONX |= (1 << STALLRQ);
         UEINTX &= ~(1 << RXSTPI);
     }
@@ -445,32 +1414,189 @@ _stall:
 
 void
 usb_u2_configure_endpoint(const usb_u2_endpoint_descriptor_t *ep)
+{
+    usb_u2_configure_endpoint_banks(ep, false);
+}
+
+
+bool
+usb_u2_configure_endpoint_banks(const usb_u2_endpoint_descriptor_t *ep, bool double_bank)
 {
     if (ep == NULL)
-        return;
+        return false;
 
     uint8_t epaddr = pgm_read_byte(&(ep->bEndpointAddress));
     uint8_t epnum = epaddr & 0xf;
-    if (epnum != epmax + 1)
-        return;
-    epmax++;
+    // series 2 don't have more than 5 endpoints (including 0). endpoints
+    // must be configured in order, but unused ones may be skipped.
+    if (epnum <= epmax || epnum > 4)
+        return false;
+    epmax = epnum;
+
+    if (double_bank)
+        double_banks |= (1 << epnum);
+    else
+        double_banks &= ~(1 << epnum);
 
     uint8_t eps = pgm_read_byte(&(ep->wMaxPacketSize));
+    uint8_t uenum = UENUM;
 
     UENUM = epnum;
     UECONX |= (1 << EPEN);
     UECFG0X = (pgm_read_byte(&(ep->bmAttributes)) << EPTYPE0) | (((epaddr & 0x80) ? 1 : 0) << EPDIR);
-    UECFG1X = ((eps <= 8) ? 0 : ((eps <= 16) ? 1 : ((eps <= 32) ? 2 : 3)) << EPSIZE0) | (1 << ALLOC);
+    UECFG1X = ((eps <= 8) ? 0 : ((eps <= 16) ? 1 : ((eps <= 32) ? 2 : 3)) << EPSIZE0) |
+        (double_bank ? (1 << EPBK0) : 0) | (1 << ALLOC);
     UERST = (1 << EPRST0) | (1 << EPRST1) | (1 << EPRST2) | (1 << EPRST3) | (1 << EPRST4);
     UERST = 0;
-    UENUM = 0;
+
+    // dpram is only 176 bytes, allocation fails if layout does not fit
+    bool rv = (UESTA0X & (1 << CFGOK)) != 0;
+
+#ifdef USB_U2_ENDPOINT_HANDLERS
+    if (rv && endpoint_handlers[epnum - 1] != NULL)
+        endpoint_interrupt_enable();
+#endif
+
+    UENUM = uenum;
+    return rv;
+}
+
+
+#ifdef USB_U2_ENUM_PROFILE
+static uint8_t
+enum_stage(void)
+{
+    if ((req.bmRequestType & USB_U2_REQ_TYPE_MASK) != USB_U2_REQ_TYPE_STANDARD)
+        return USB_U2_ENUM_STAGES;
+
+    switch (req.bRequest) {
+        case USB_U2_REQ_GET_DESCRIPTOR:
+            switch (req.wValue >> 8) {
+                case USB_U2_DESCR_TYPE_DEVICE:
+                    return USB_U2_ENUM_STAGE_DEVICE_DESCR;
+                case USB_U2_DESCR_TYPE_CONFIGURATION:
+                    return USB_U2_ENUM_STAGE_CONFIG_DESCR;
+                case USB_U2_DESCR_TYPE_STRING:
+                    return USB_U2_ENUM_STAGE_STRING_DESCR;
+            }
+            break;
+
+        case USB_U2_REQ_SET_ADDRESS:
+            return USB_U2_ENUM_STAGE_SET_ADDRESS;
+
+        case USB_U2_REQ_SET_CONFIGURATION:
+            return USB_U2_ENUM_STAGE_SET_CONFIG;
+    }
+
+    return USB_U2_ENUM_STAGES;
+}
+
+
+static uint16_t
+enum_now_ms(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t rv = enum_ms;
+    SREG = sreg;
+    return rv;
+}
+
+
+static uint32_t
+timer1_ticks_per_ms(void)
+{
+    switch (TCCR1B & ((1 << CS12) | (1 << CS11) | (1 << CS10))) {
+        case (1 << CS10):
+            return F_CPU / 1000;
+        case (1 << CS11):
+            return F_CPU / 8000;
+        case (1 << CS11) | (1 << CS10):
+            return F_CPU / 64000;
+        case (1 << CS12):
+            return F_CPU / 256000;
+        case (1 << CS12) | (1 << CS10):
+            return F_CPU / 1024000;
+    }
+
+    // stopped or external clock
+    return 0;
+}
+
+
+static void
+handle_ctrl_profiled(void)
+{
+    if (!enum_setup_seen) {
+        enum_setup_seen = true;
+        enum_stages[USB_U2_ENUM_STAGE_RESET_TO_SETUP].end_ms = enum_now_ms();
+        enum_stages[USB_U2_ENUM_STAGE_RESET_TO_SETUP].requests = 1;
+    }
+
+    // ticks include the time waiting for host inside the request.
+    uint16_t start_ms = enum_now_ms();
+    uint16_t start = TCNT1;
+    handle_ctrl();
+    uint16_t ticks = TCNT1 - start;
+    uint16_t end_ms = enum_now_ms();
+
+    // timer1 wraps after 65536 ticks (4ms at 16MHz without prescaler). the
+    // SOF count is off by less than 1ms, that is always less than half a
+    // wrap, so it tells how many times the timer wrapped.
+    uint32_t cycles = ticks;
+    uint32_t estimate = (uint32_t) (uint16_t) (end_ms - start_ms) * timer1_ticks_per_ms();
+    if (estimate > cycles)
+        cycles += (estimate - cycles + 0x8000) & 0xffff0000UL;
+
+    uint8_t stage = enum_stage();
+    if (stage >= USB_U2_ENUM_STAGES)
+        return;
+
+    enum_stages[stage].cycles += cycles;
+    enum_stages[stage].end_ms = end_ms;
+    enum_stages[stage].requests++;
 }
 
 
+void
+usb_u2_enum_profile(usb_u2_enum_stage_t *stages)
+{
+    if (stages == NULL)
+        return;
+
+    // stages are cleared by bus reset, from USB_GEN_vect
+    uint8_t sreg = SREG;
+    cli();
+
+    for (uint8_t i = 0; i < USB_U2_ENUM_STAGES; i++)
+        stages[i] = enum_stages[i];
+
+    SREG = sreg;
+}
+#endif
+
+
 void
 usb_u2_task(void)
 {
+#ifdef USB_U2_DEFER_RESET_HOOK
+    if (reset_hook_pending) {
+        reset_hook_pending = false;
+        if (usb_u2_reset_hook_cb != NULL)
+            usb_u2_reset_hook_cb();
+    }
+#endif
+
+    uint8_t uenum = UENUM;
+
     UENUM = 0;
-    if ((UEINTX & (1 << RXSTPI)) != 0)
+    if ((UEINTX & (1 << RXSTPI)) != 0) {
+#ifdef USB_U2_ENUM_PROFILE
+        handle_ctrl_profiled();
+#else
         handle_ctrl();
+#endif
+    }
+
+    UENUM = uenum;
 }
@@ -12,6 +12,40 @@
 #include <stdint.h>
 
 
+// Library settings
+
+// alternate settings are tracked for interfaces below this number. on
+// SET_INTERFACE, the endpoints from the lowest one used by the interface up
+// to endpoint 4 are rebuilt, so interfaces with alternate settings must use
+// the highest endpoint numbers. a switch that would rebuild endpoints of
+// another interface active setting, or whose endpoints do not fit in dpram,
+// is stalled. usb_u2_interface_double_bank_cb() picks the banks of each
+// rebuilt endpoint, if defined.
+#ifndef USB_U2_MAX_INTERFACES
+#define USB_U2_MAX_INTERFACES   4
+#endif
+
+// USB_U2_DEFER_RESET_HOOK: call usb_u2_reset_hook_cb() from usb_u2_task()
+// instead of USB_GEN_vect.
+//
+// USB_U2_ISR_TIMING: track worst case duration of USB_GEN_vect and
+// USB_COM_vect bodies in timer1 ticks. timer1 is started without prescaler
+// by usb_u2_init() if not running already.
+//
+// USB_U2_ENDPOINT_HANDLERS: dispatch endpoint interrupts to handlers set
+// with usb_u2_endpoint_register(). the library then defines USB_COM_vect,
+// so the application must not define it.
+//
+// USB_U2_ENUM_PROFILE: track timer1 ticks and wall time (from SOF) of each
+// enumeration stage since last bus reset. uses timer1 as above, and expects
+// it to count up to 0xffff (normal mode) if the application runs it.
+
+// control transfer stages are aborted after waiting this many frames for host
+#ifndef USB_U2_CONTROL_TIMEOUT_FRAMES
+#define USB_U2_CONTROL_TIMEOUT_FRAMES   100
+#endif
+
+
 // Request (Setup) data macros
 
 #define USB_U2_REQ_DIR_HOST_TO_DEVICE (0 << 7)
@@ -41,6 +75,8 @@
 #define USB_U2_REQ_SET_INTERFACE      0x0b
 #define USB_U2_REQ_SYNCH_FRAME        0x0c
 
+#define USB_U2_FEATURE_ENDPOINT_HALT  0x00
+
 
 // Descriptor macros
 
@@ -112,6 +148,17 @@
 #define USB_U2_STATE_CONFIGURED 2
 
 
+// Enumeration profile macros
+
+#define USB_U2_ENUM_STAGE_RESET_TO_SETUP    0
+#define USB_U2_ENUM_STAGE_DEVICE_DESCR      1
+#define USB_U2_ENUM_STAGE_SET_ADDRESS       2
+#define USB_U2_ENUM_STAGE_CONFIG_DESCR      3
+#define USB_U2_ENUM_STAGE_STRING_DESCR      4
+#define USB_U2_ENUM_STAGE_SET_CONFIG        5
+#define USB_U2_ENUM_STAGES                  6
+
+
 // Request (setup) types
 
 typedef struct {
@@ -122,6 +169,67 @@ typedef struct {
     uint16_t wLength;
 } __attribute__((packed)) usb_u2_control_request_t;
 
+typedef void (*usb_u2_control_handler_t)(const usb_u2_control_request_t *req);
+typedef struct {
+    const uint8_t *b;
+    uint16_t len;
+    bool from_progmem;
+} usb_u2_iovec_t;
+
+typedef struct {
+    uint16_t gen_max_ticks;
+    uint16_t com_max_ticks;
+} usb_u2_isr_timing_t;
+
+typedef struct {
+    uint32_t cycles;    // timer1 ticks spent handling the stage requests
+    uint16_t end_ms;    // ms since bus reset when the last request finished
+    uint8_t  requests;
+} usb_u2_enum_stage_t;
+
+typedef void (*usb_u2_endpoint_handler_t)(uint8_t ep);
+typedef bool (*usb_u2_control_out_consumer_t)(uint8_t len, uint16_t offset);  // reads len bytes from UEDATX
+
+
+// String table types and macros
+
+typedef struct {
+    uint16_t langid;
+    uint8_t num_strings;
+    const char* const *strings;  // PROGMEM array of UTF-8 PROGMEM strings, for string ids 1..num_strings
+} usb_u2_string_language_t;
+
+// entries must be sorted by langid, e.g.:
+//
+// USB_U2_STRING_LANGUAGES(
+//     {0x0407, 2, strings_de_de},
+//     {0x0409, 2, strings_en_us},
+// );
+#define USB_U2_STRING_LANGUAGES(...)                                                    \
+    const usb_u2_string_language_t usb_u2_string_languages[] PROGMEM = {__VA_ARGS__};   \
+    const uint8_t usb_u2_string_languages_len PROGMEM =                                 \
+        sizeof(usb_u2_string_languages) / sizeof(usb_u2_string_language_t)
+
+
+// Vendor request table types and macros
+
+typedef struct {
+    uint8_t bRequest;
+    uint8_t direction;
+    usb_u2_control_handler_t handler;
+} usb_u2_vendor_request_t;
+
+// entries must be placed at the index of their bRequest, e.g.:
+//
+// USB_U2_VENDOR_REQUESTS(
+//     [MY_REQ_READ] = {MY_REQ_READ, USB_U2_REQ_DIR_DEVICE_TO_HOST, my_read},
+//     [MY_REQ_WRITE] = {MY_REQ_WRITE, USB_U2_REQ_DIR_HOST_TO_DEVICE, my_write},
+// );
+#define USB_U2_VENDOR_REQUESTS(...)                                                 \
+    const usb_u2_vendor_request_t usb_u2_vendor_requests[] PROGMEM = {__VA_ARGS__}; \
+    const uint16_t usb_u2_vendor_requests_len PROGMEM =                             \
+        sizeof(usb_u2_vendor_requests) / sizeof(usb_u2_vendor_request_t)
+
 
 // Descriptor types
 
@@ -187,21 +295,46 @@ typedef struct {
 void usb_u2_init(void);
 void usb_u2_task(void);
 void usb_u2_configure_endpoint(const usb_u2_endpoint_descriptor_t *ep);
+bool usb_u2_configure_endpoint_banks(const usb_u2_endpoint_descriptor_t *ep, bool double_bank);
 uint8_t usb_u2_control_in(const uint8_t *b, size_t len, bool from_progmem);
 uint8_t usb_u2_control_out(uint8_t *b, size_t len);
+uint16_t usb_u2_control_out_stream(usb_u2_control_out_consumer_t consumer);
 void usb_u2_control_out_status(void);
+void usb_u2_control_defer(void);
+const usb_u2_control_request_t* usb_u2_control_deferred_request(void);
+void usb_u2_isr_timing(usb_u2_isr_timing_t *t, bool reset);  // USB_U2_ISR_TIMING only
+void usb_u2_enum_profile(usb_u2_enum_stage_t *stages);        // USB_U2_ENUM_PROFILE only
+bool usb_u2_control_class_register(uint8_t rcpt, uint8_t index, usb_u2_control_handler_t handler);
 void usb_u2_endpoint_select(uint8_t ep);
+bool usb_u2_endpoint_register(uint8_t ep, usb_u2_endpoint_handler_t handler);  // USB_U2_ENDPOINT_HANDLERS only
+void usb_u2_endpoint_resume(uint8_t ep);                                        // USB_U2_ENDPOINT_HANDLERS only
 bool usb_u2_endpoint_in_ready(void);
 uint8_t usb_u2_endpoint_in(const uint8_t *b, size_t len);
+uint16_t usb_u2_endpoint_in_iov(const usb_u2_iovec_t *iov, uint8_t iovcnt);
 bool usb_u2_endpoint_out_received(void);
 uint8_t usb_u2_endpoint_out(uint8_t *data, uint8_t len);
+uint8_t usb_u2_endpoint_out_length(void);
+uint8_t usb_u2_endpoint_out_partial(uint8_t *data, uint8_t len);
+
+
+// String table, usually defined with USB_U2_STRING_LANGUAGES()
+extern const usb_u2_string_language_t usb_u2_string_languages[] __attribute__((weak));
+extern const uint8_t usb_u2_string_languages_len __attribute__((weak));
+
+// Vendor request table, usually defined with USB_U2_VENDOR_REQUESTS()
+extern const usb_u2_vendor_request_t usb_u2_vendor_requests[] __attribute__((weak));
+extern const uint16_t usb_u2_vendor_requests_len __attribute__((weak));  // up to 256 entries
 
 
 // Callbacks
 const usb_u2_device_descriptor_t* usb_u2_device_descriptor_cb(void);
-const usb_u2_config_descriptor_t* usb_u2_config_descriptor_cb(uint8_t config_id);
-const usb_u2_string_descriptor_t* usb_u2_string_descriptor_cb(uint8_t string_id, uint16_t lang_id);
-void usb_u2_configure_endpoints_cb(uint8_t config_id) __attribute__((weak));
+const usb_u2_config_descriptor_t* usb_u2_config_descriptor_cb(uint8_t config_index);  // 0-based
+const usb_u2_string_descriptor_t* usb_u2_string_descriptor_cb(uint8_t string_id, uint16_t lang_id) __attribute__((weak));
+const char* usb_u2_string_cb(uint8_t string_id, uint16_t lang_id) __attribute__((weak));  // UTF-8, PROGMEM
+void usb_u2_configure_endpoints_cb(uint8_t config_value) __attribute__((weak));  // bConfigurationValue
+void usb_u2_control_class_cb(const usb_u2_control_request_t *req) __attribute__((weak));
 void usb_u2_control_vendor_cb(const usb_u2_control_request_t *req) __attribute__((weak));
 void usb_u2_reset_hook_cb(void) __attribute__((weak));
 void usb_u2_set_address_hook_cb(uint8_t addr) __attribute__((weak));
+void usb_u2_set_interface_hook_cb(uint8_t iface, uint8_t alt) __attribute__((weak));
+bool usb_u2_interface_double_bank_cb(uint8_t iface, uint8_t alt, uint8_t ep) __attribute__((weak));